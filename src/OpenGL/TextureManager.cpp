@@ -36,6 +36,9 @@ TextureManager::~TextureManager() {
     for (const auto &[_, id] : cube_map) {
         glDeleteTextures(1, &id);
     }
+    for (const auto &[_, img] : image) {
+        glDeleteTextures(1, &img.id);
+    }
 }
 
 unsigned int TextureManager::LoadTexture(const std::string &path, bool gamma) {
@@ -158,4 +161,32 @@ unsigned int TextureManager::LoadHDR(const std::string &path) {
     return id;
 }
 
+unsigned int TextureManager::UpdateImage(const std::string &name, int width, int height,
+        const unsigned char *data) {
+    // rows of rgb bytes are not 4-byte aligned in general
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    auto it = image.find(name);
+    if (it != image.end() && it->second.width == width && it->second.height == height) {
+        glBindTexture(GL_TEXTURE_2D, it->second.id);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, data);
+    } else {
+        if (it == image.end()) {
+            it = image.emplace(name, Image()).first;
+            glGenTextures(1, &it->second.id);
+        }
+        it->second.width = width;
+        it->second.height = height;
+        glBindTexture(GL_TEXTURE_2D, it->second.id);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    return it->second.id;
+}
+
 }
\ No newline at end of file
@@ -13,10 +13,20 @@ class TextureManager {
     unsigned int LoadCubemap(const std::string &path, const std::string &suffix,
         bool gamma = false);
     unsigned int LoadHDR(const std::string &path);
+    // rgb texture of an image that changes, like the ray trace preview, data
+    // are rows from the bottom, reallocated when the size changes
+    unsigned int UpdateImage(const std::string &name, int width, int height,
+        const unsigned char *data);
 
   private:
+    struct Image {
+        unsigned int id;
+        int width, height;
+    };
+
     std::unordered_map<std::string, unsigned int> texture;
     std::unordered_map<std::string, unsigned int> cube_map;
+    std::unordered_map<std::string, Image> image;
 };
 
 }
\ No newline at end of file
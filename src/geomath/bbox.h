@@ -6,7 +6,9 @@
 namespace pepcy::gm {
 
 struct BBox {
-    BBox() : p_min(Vector3()), p_max(Vector3()) {}
+    // default bbox is empty, so that expanding it by anything gives that thing
+    BBox() : p_min(Vector3(std::numeric_limits<float>::max())),
+        p_max(Vector3(-std::numeric_limits<float>::max())) {}
     BBox(const Vector3 &p_min, const Vector3 &p_max) :
         p_min(p_min), p_max(p_max) {}
 
@@ -16,10 +18,18 @@ struct BBox {
                p_min[2] <= point[2] && point[2] <= p_max[2];
     }
 
+    bool IsEmpty() const {
+        return p_min[0] > p_max[0] || p_min[1] > p_max[1] || p_min[2] > p_max[2];
+    }
+
     void Expand(const BBox &rhs) {
         p_min = Min(p_min, rhs.p_min);
         p_max = Max(p_max, rhs.p_max);
     }
+    void Expand(const Vector3 &point) {
+        p_min = Min(p_min, point);
+        p_max = Max(p_max, point);
+    }
     friend BBox Combine(const BBox &a, const BBox &b) {
         return BBox(Min(a.p_min, b.p_min), Max(a.p_max, b.p_max));
     }
@@ -38,7 +48,15 @@ struct BBox {
     }
 
     float SurfaceArea() const {
-        return (p_max[0] - p_min[0]) * (p_max[1] - p_min[1]) * (p_max[2] - p_min[2]);
+        if (IsEmpty()) {
+            return 0.0f;
+        }
+        Vector3 d = p_max - p_min;
+        return 2.0f * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+    }
+    int MaxExtent() const {
+        Vector3 d = p_max - p_min;
+        return d[0] > d[1] && d[0] > d[2] ? 0 : (d[1] > d[2] ? 1 : 2);
     }
     Vector3 Centroid() const {
         return (p_min + p_max) / 2.0f;
@@ -5,6 +5,7 @@
 namespace pepcy::gm {
 
 struct Ray {
+    Ray() : t_min(0.001f), t_max(100.0f) {}
     Ray(const Vector3 &orig, const Vector3 &dir) : orig(orig), dir(Normalize(dir)),
         t_min(0.001f), t_max(100.0f) {}
 
@@ -234,6 +234,8 @@ int main() {
             }
             if (load_browser.Display()) {
                 auto new_scene = loader.ReadFile(load_browser.path);
+                // a progressive trace must not outlive the shapes it hits
+                raytrace_viewer.StopProgressive();
                 pscene->Clear();
                 *pscene = new_scene;
                 viewer_config.scene = pscene;
@@ -265,6 +267,113 @@ int main() {
             if (ImGui::Button("ray trace")) {
                 raytrace_viewer.Draw();
             }
+            // progressive ray trace, shown in the preview window and restarted
+            // when the camera moves
+            ImGui::SameLine();
+            if (ImGui::Button("progressive")) {
+                raytrace_viewer.StartProgressive();
+            }
+            if (raytrace_viewer.IsProgressive()) {
+                ImGui::SameLine();
+                if (ImGui::Button("stop")) {
+                    raytrace_viewer.StopProgressive();
+                }
+                ImGui::SameLine();
+                if (ImGui::Button("save image")) {
+                    raytrace_viewer.SaveImage();
+                }
+            }
+            static int sampler = static_cast<int>(SamplerType::Sobol);
+            ImGui::RadioButton("random", &sampler, 0);
+            ImGui::SameLine();
+            ImGui::RadioButton("Halton", &sampler, 1);
+            ImGui::SameLine();
+            ImGui::RadioButton("Sobol", &sampler, 2);
+            raytrace_config.sampler = static_cast<SamplerType>(sampler);
+            ImGui::Checkbox("adaptive sampling", &raytrace_config.adaptive);
+            if (raytrace_config.adaptive) {
+                ImGui::SliderFloat("error threshold", &raytrace_config.adaptive_threshold,
+                    0.01f, 0.5f);
+            }
+            ImGui::Checkbox("sample lights", &raytrace_config.sample_lights);
+            if (raytrace_config.sample_lights) {
+                ImGui::SliderInt("light samples", &raytrace_config.light_samples, 1, 8);
+            }
+            ImGui::Checkbox("wavefront", &raytrace_config.wavefront);
+            if (raytrace_config.wavefront) {
+                ImGui::SameLine();
+                ImGui::Checkbox("sort rays", &raytrace_config.wavefront_sort);
+            }
+            // acceleration structure, auto tune may change the structure, the
+            // leaf size, the bin count and the grid density
+            AcceleratorConfig &accel = raytrace_config.accel;
+            if (ImGui::RadioButton("BVH", accel.type == AcceleratorType::BVH)) {
+                accel.type = AcceleratorType::BVH;
+            }
+            ImGui::SameLine();
+            if (ImGui::RadioButton("Grid", accel.type == AcceleratorType::Grid)) {
+                accel.type = AcceleratorType::Grid;
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("auto tune")) {
+                raytrace_viewer.SetConfig(raytrace_config);
+                accel = raytrace_viewer.AutoTune();
+            }
+            static int bvh_build = 0;
+            ImGui::RadioButton("SAH", &bvh_build, 0);
+            ImGui::SameLine();
+            ImGui::RadioButton("LBVH", &bvh_build, 1);
+            ImGui::SameLine();
+            ImGui::RadioButton("HLBVH", &bvh_build, 2);
+            ImGui::SameLine();
+            ImGui::RadioButton("SBVH", &bvh_build, 3);
+            accel.bvh_build = static_cast<BVHBuildMethod>(bvh_build);
+            ImGui::SliderInt("leaf size", &accel.bvh_params.max_leaf_size, 1, 32);
+            ImGui::SliderInt("bins", &accel.bvh_params.n_bins, 2, BVHTree::MAX_BINS);
+            ImGui::SliderFloat("grid density", &accel.grid_density, 0.25f, 8.0f);
+            ImGui::Checkbox("compress BVH", &accel.bvh_compressed);
+            ImGui::SameLine();
+            ImGui::Checkbox("analytic shapes", &accel.analytic_shapes);
+            ImGui::Checkbox("count traversal", &raytrace_config.count_traversal);
+            ImGui::SameLine();
+            if (ImGui::Button("save stats")) {
+                raytrace_viewer.SaveStats();
+            }
+
+            // bvh stats of the last ray trace
+            if (ImGui::CollapsingHeader("BVH Stats")) {
+                const SceneBVH &scene_bvh = raytrace_viewer.GetSceneBVH();
+                ImGui::Text("instances: %d, shape BVHs: %d", scene_bvh.GetInstanceCount(),
+                    scene_bvh.GetShapeBVHCount());
+                BVHStats stats[2] = { scene_bvh.GetTopStats(), scene_bvh.GetShapeStats() };
+                const char *names[2] = { "top level", "shapes" };
+                for (int i = 0; i < 2; i++) {
+                    const BVHStats &s = stats[i];
+                    ImGui::Text("%s", names[i]);
+                    ImGui::Text("  nodes: %d, leaves: %d, refs: %d, max depth: %d",
+                        s.n_nodes, s.n_leaves, s.n_refs, s.max_depth);
+                    ImGui::Text("  sah cost: %.2f, memory: %.2f MB, build: %.2f ms",
+                        s.sah_cost, s.memory / 1048576.0, s.build_ms);
+                    ImGui::Text("  bytes per primitive: %.1f",
+                        s.n_prims > 0 ? double(s.memory) / s.n_prims : 0.0);
+                    std::vector<float> depth_hist(s.depth_hist.begin(), s.depth_hist.end());
+                    std::vector<float> size_hist(s.leaf_size_hist.begin(), s.leaf_size_hist.end());
+                    ImGui::PushID(i);
+                    ImGui::PlotHistogram("leaf depth", depth_hist.data(), depth_hist.size(),
+                        0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 40));
+                    ImGui::PlotHistogram("leaf size", size_hist.data(), size_hist.size(),
+                        0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 40));
+                    ImGui::PopID();
+                }
+                const BVHCounters &c = raytrace_viewer.GetCounters();
+                ImGui::Text("trace: %.2f ms", raytrace_viewer.GetTraceTime());
+                if (c.rays > 0) {
+                    ImGui::Text("  rays: %llu", (unsigned long long) c.rays);
+                    ImGui::Text("  per ray: %.2f nodes, %.2f boxes, %.2f instances, %.2f triangles",
+                        double(c.nodes) / c.rays, double(c.boxes) / c.rays,
+                        double(c.instances) / c.rays, double(c.triangles) / c.rays);
+                }
+            }
 
             // skybox
             ImGui::Separator();
@@ -583,6 +692,25 @@ int main() {
 
             ImGui::End();
         }
+        {
+            static uint64_t preview_version = 0;
+            static std::vector<unsigned char> preview;
+            static int preview_width = 0, preview_height = 0;
+            static unsigned int preview_tex = 0;
+            if (raytrace_viewer.GetPreview(preview_version, preview, preview_width,
+                    preview_height)) {
+                preview_tex = opengl_viewer.tex_mgr.UpdateImage("ray trace preview",
+                    preview_width, preview_height, preview.data());
+            }
+            if (raytrace_viewer.IsProgressive() && preview_tex != 0) {
+                ImGui::Begin("Ray Trace Preview");
+                ImGui::Text("samples per pixel: %d", raytrace_viewer.GetPassCount());
+                // the image is stored from the bottom row
+                ImGui::Image((ImTextureID) (intptr_t) preview_tex,
+                    ImVec2(preview_width, preview_height), ImVec2(0, 1), ImVec2(1, 0));
+                ImGui::End();
+            }
+        }
 
         for (const auto &light : pscene->GetDirLights()) {
             if (light.shadow && light.realtime) {
@@ -604,9 +732,11 @@ int main() {
 
         opengl_viewer.SetConfig(viewer_config);
         raytrace_viewer.SetConfig(raytrace_config);
+        raytrace_viewer.Update();
     };
 
     win.MainLoop();
+    raytrace_viewer.StopProgressive();
 
     pscene->Clear();
 
@@ -0,0 +1,102 @@
+#include "Accelerator.h"
+
+#include "RayPacket.h"
+
+namespace pepcy::renderer {
+
+bool operator==(const AcceleratorConfig &lhs, const AcceleratorConfig &rhs) {
+    return lhs.type == rhs.type && lhs.bvh_build == rhs.bvh_build &&
+        lhs.bvh_params.max_leaf_size == rhs.bvh_params.max_leaf_size &&
+        lhs.bvh_params.n_bins == rhs.bvh_params.n_bins &&
+        lhs.bvh_params.max_duplication == rhs.bvh_params.max_duplication &&
+        lhs.bvh_compressed == rhs.bvh_compressed && lhs.grid_density == rhs.grid_density &&
+        lhs.analytic_shapes == rhs.analytic_shapes;
+}
+
+bool operator!=(const AcceleratorConfig &lhs, const AcceleratorConfig &rhs) {
+    return !(lhs == rhs);
+}
+
+void Accelerator::SetShape(const Shape *sh) {
+    this->sh = sh;
+    n_tris = sh->GetIndexCount() / 3;
+}
+
+Triangle Accelerator::GetTriangle(int i) const {
+    const unsigned int *p_ind = sh->GetIndices() + 3 * i;
+    return Triangle(sh, p_ind[0], p_ind[1], p_ind[2]);
+}
+
+std::vector<gm::BBox> Accelerator::GetTriangleBounds() const {
+    std::vector<gm::BBox> bounds(n_tris);
+    for (int i = 0; i < n_tris; i++) {
+        bounds[i] = GetTriangle(i).GetLocalBBox();
+    }
+    return bounds;
+}
+
+template <int N>
+uint32_t Accelerator::IntersectRays(RayPacket<N> &p, uint32_t mask,
+        HitRecord *hits) const {
+    uint32_t hit = 0;
+    for (int k = 0; k < N; k++) {
+        if ((mask >> k & 1) && Intersect(p.rays[k], hits[k])) {
+            hit |= 1u << k;
+        }
+    }
+    return hit;
+}
+
+template <int N>
+uint32_t Accelerator::OccludedRays(RayPacket<N> &p, uint32_t mask) const {
+    uint32_t occluded = 0;
+    for (int k = 0; k < N; k++) {
+        if ((mask >> k & 1) && Occluded(p.rays[k])) {
+            occluded |= 1u << k;
+        }
+    }
+    return occluded;
+}
+
+uint32_t Accelerator::Intersect(RayPacket<4> &p, uint32_t mask, HitRecord *hits) const {
+    return IntersectRays(p, mask, hits);
+}
+
+uint32_t Accelerator::Intersect(RayPacket<8> &p, uint32_t mask, HitRecord *hits) const {
+    return IntersectRays(p, mask, hits);
+}
+
+uint32_t Accelerator::Intersect(RayPacket<16> &p, uint32_t mask, HitRecord *hits) const {
+    return IntersectRays(p, mask, hits);
+}
+
+uint32_t Accelerator::Occluded(RayPacket<4> &p, uint32_t mask) const {
+    return OccludedRays(p, mask);
+}
+
+uint32_t Accelerator::Occluded(RayPacket<8> &p, uint32_t mask) const {
+    return OccludedRays(p, mask);
+}
+
+uint32_t Accelerator::Occluded(RayPacket<16> &p, uint32_t mask) const {
+    return OccludedRays(p, mask);
+}
+
+void Accelerator::Interpolate(const gm::Ray &r, const HitRecord &hit,
+        Intersection &inter) const {
+    GetTriangle(hit.prim).Interpolate(r, hit.t, hit.u, hit.v, inter);
+}
+
+const Shape *Accelerator::GetShape() const {
+    return sh;
+}
+
+int Accelerator::GetTriangleCount() const {
+    return n_tris;
+}
+
+const BVHStats &Accelerator::GetStats() const {
+    return stats;
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "BVHTree.h"
+#include "Triangle.h"
+#include "TriangleSoup.h"
+
+namespace pepcy::renderer {
+
+template <int N>
+struct RayPacket;
+
+enum class AcceleratorType {
+    BVH, // 4-wide bvh, see ShapeBVH
+    Grid // two-level uniform grid, see ShapeGrid
+};
+// shapes with an exact surface always use ShapeSurface, unless
+// AcceleratorConfig::analytic_shapes is off
+
+// how the bottom level structures of a scene are built
+struct AcceleratorConfig {
+    AcceleratorType type = AcceleratorType::BVH;
+    BVHBuildMethod bvh_build = BVHBuildMethod::SAH;
+    BVHBuildParams bvh_params;
+    // quantized bvh nodes, for large scenes
+    bool bvh_compressed = false;
+    // top level grid cells per triangle, dense cells get a grid of their own
+    float grid_density = 2.0f;
+    // spheres, cylinders and capsules are intersected exactly, instead of as
+    // triangles
+    bool analytic_shapes = true;
+};
+
+bool operator==(const AcceleratorConfig &lhs, const AcceleratorConfig &rhs);
+bool operator!=(const AcceleratorConfig &lhs, const AcceleratorConfig &rhs);
+
+// closest hit found by a traversal, the Intersection is only built from it
+// once the traversal is done
+struct HitRecord {
+    float t;
+    float u, v; // weights of the second and the third vertex
+    int prim; // triangle of the shape
+    int inst; // instance of the scene, set by SceneBVH
+};
+
+// acceleration structure over the triangles of a shape, in its object space
+class Accelerator {
+  public:
+    virtual ~Accelerator() = default;
+
+    virtual void Build(const Shape *sh, const AcceleratorConfig &config) = 0;
+
+    // closest hit, shrinks r.t_max to the hit, hit.inst is left as is
+    virtual bool Intersect(const gm::Ray &r, HitRecord &hit) const = 0;
+    // any hit, for shadow rays
+    virtual bool Occluded(const gm::Ray &r) const = 0;
+    // packet versions, return the lanes that hit and the occluded lanes
+    // by default the rays are traced one by one
+    virtual uint32_t Intersect(RayPacket<4> &p, uint32_t mask, HitRecord *hits) const;
+    virtual uint32_t Intersect(RayPacket<8> &p, uint32_t mask, HitRecord *hits) const;
+    virtual uint32_t Intersect(RayPacket<16> &p, uint32_t mask, HitRecord *hits) const;
+    virtual uint32_t Occluded(RayPacket<4> &p, uint32_t mask) const;
+    virtual uint32_t Occluded(RayPacket<8> &p, uint32_t mask) const;
+    virtual uint32_t Occluded(RayPacket<16> &p, uint32_t mask) const;
+
+    virtual gm::BBox GetBBox() const = 0;
+
+    // shading attributes of a hit of r found by Intersect, in object space
+    virtual void Interpolate(const gm::Ray &r, const HitRecord &hit, Intersection &inter) const;
+
+    const Shape *GetShape() const;
+    int GetTriangleCount() const;
+    // stats of the structure, memory and build time include the triangles
+    const BVHStats &GetStats() const;
+
+  protected:
+    void SetShape(const Shape *sh);
+    // triangles are referenced by their index in the index buffer of sh
+    Triangle GetTriangle(int i) const;
+    std::vector<gm::BBox> GetTriangleBounds() const;
+
+    template <int N>
+    uint32_t IntersectRays(RayPacket<N> &p, uint32_t mask, HitRecord *hits) const;
+    template <int N>
+    uint32_t OccludedRays(RayPacket<N> &p, uint32_t mask) const;
+
+    const Shape *sh = nullptr;
+    int n_tris = 0;
+    // positions of the triangles, in the order the structure visits them
+    TriangleSoup soup;
+    BVHStats stats;
+};
+
+}
\ No newline at end of file
@@ -0,0 +1,203 @@
+#include "BVH4.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+namespace pepcy::renderer {
+
+void BVH4::Build(const BVHTree &tree, bool compressed, int leaf_align) {
+    nodes.clear();
+    qnodes.clear();
+    indices = tree.GetIndices();
+    leaf_order = false;
+    bbox = tree.GetBBox();
+
+    const std::vector<BVHNode> &bin = tree.GetNodes();
+    if (bin.empty()) {
+        return;
+    }
+    nodes.reserve(bin.size() / 2 + 1);
+    Collapse(bin, 0);
+    if (leaf_align > 1) {
+        AlignLeaves(leaf_align);
+    }
+    if (compressed) {
+        Compress();
+    } else {
+        // the reserve above assumes binary nodes, wide ones are fewer
+        nodes.shrink_to_fit();
+    }
+}
+
+int BVH4::Collapse(const std::vector<BVHNode> &bin, int id) {
+    // open the interior child with the largest surface area until the node
+    // is full or only leaves are left
+    int ch[WIDTH];
+    int n = 0;
+    if (bin[id].IsLeaf()) {
+        ch[n++] = id;
+    } else {
+        ch[n++] = id + 1;
+        ch[n++] = bin[id].offset;
+    }
+    while (n < WIDTH) {
+        int best = -1;
+        float best_area = -1.0f;
+        for (int i = 0; i < n; i++) {
+            float area = bin[ch[i]].bbox.SurfaceArea();
+            if (!bin[ch[i]].IsLeaf() && area > best_area) {
+                best = i;
+                best_area = area;
+            }
+        }
+        if (best == -1) break;
+        int u = ch[best];
+        ch[best] = u + 1;
+        ch[n++] = bin[u].offset;
+    }
+
+    int wid = nodes.size();
+    nodes.emplace_back();
+    BVH4Node &w = nodes[wid];
+    w.n_children = n;
+    w.pad = 0;
+    for (int i = 0; i < WIDTH; i++) {
+        for (int d = 0; d < 3; d++) {
+            w.b_min[d][i] = i < n ? bin[ch[i]].bbox.p_min[d] : FLT_MAX;
+            w.b_max[d][i] = i < n ? bin[ch[i]].bbox.p_max[d] : -FLT_MAX;
+        }
+        w.child[i] = -1;
+        w.n_prims[i] = 0;
+    }
+    for (int i = 0; i < n; i++) {
+        const BVHNode &c = bin[ch[i]];
+        if (c.IsLeaf()) {
+            nodes[wid].child[i] = c.offset;
+            nodes[wid].n_prims[i] = c.n_prims;
+        } else {
+            int cid = Collapse(bin, ch[i]);
+            nodes[wid].child[i] = cid;
+        }
+    }
+    return wid;
+}
+
+void BVH4::AlignLeaves(int align) {
+    std::vector<int> aligned;
+    aligned.reserve(indices.size() * 2);
+    for (BVH4Node &w : nodes) {
+        for (int i = 0; i < w.n_children; i++) {
+            if (!w.IsLeaf(i)) continue;
+            int first = w.child[i];
+            w.child[i] = aligned.size();
+            aligned.insert(aligned.end(), indices.begin() + first,
+                indices.begin() + first + w.n_prims[i]);
+            aligned.resize((aligned.size() + align - 1) / align * align, -1);
+        }
+    }
+    aligned.shrink_to_fit();
+    indices = std::move(aligned);
+}
+
+// grid of 255 steps from lo that reaches at least hi, when decoded as
+// lo + q * scale in floats
+static float QuantizeScale(float lo, float hi) {
+    float scale = (hi - lo) / 255.0f;
+    while (lo + 255 * scale < hi) {
+        scale = std::nextafter(scale, FLT_MAX);
+    }
+    return scale;
+}
+
+// grid steps of a child box, rounded outwards
+static void Quantize(float lo, float hi, float origin, float scale,
+        unsigned char &q_lo, unsigned char &q_hi) {
+    if (scale == 0.0f) {
+        q_lo = q_hi = 0;
+        return;
+    }
+    int a = std::clamp(int(std::floor((lo - origin) / scale)), 0, 255);
+    int b = std::clamp(int(std::ceil((hi - origin) / scale)), 0, 255);
+    while (a > 0 && origin + a * scale > lo) {
+        --a;
+    }
+    while (b < 255 && origin + b * scale < hi) {
+        ++b;
+    }
+    q_lo = a;
+    q_hi = b;
+}
+
+void BVH4::Compress() {
+    for (const BVH4Node &w : nodes) {
+        for (int i = 0; i < w.n_children; i++) {
+            if (w.n_prims[i] > 32 ||
+                    (w.IsLeaf(i) && unsigned(w.child[i]) > BVH4QNode::LEAF_FIRST_MASK)) {
+                return;
+            }
+        }
+    }
+
+    // nodes keep their indices, so interior children need no remapping
+    qnodes.resize(nodes.size());
+    for (int id = 0; id < nodes.size(); id++) {
+        const BVH4Node &w = nodes[id];
+        BVH4QNode &q = qnodes[id];
+        for (int d = 0; d < 3; d++) {
+            float lo = FLT_MAX, hi = -FLT_MAX;
+            for (int i = 0; i < w.n_children; i++) {
+                lo = std::min(lo, w.b_min[d][i]);
+                hi = std::max(hi, w.b_max[d][i]);
+            }
+            q.origin[d] = lo;
+            q.scale[d] = QuantizeScale(lo, hi);
+            for (int i = 0; i < WIDTH; i++) {
+                if (i < w.n_children) {
+                    Quantize(w.b_min[d][i], w.b_max[d][i], lo, q.scale[d],
+                        q.q_min[d][i], q.q_max[d][i]);
+                } else {
+                    q.q_min[d][i] = 255;
+                    q.q_max[d][i] = 0;
+                }
+            }
+        }
+        for (int i = 0; i < WIDTH; i++) {
+            if (i >= w.n_children) {
+                q.child[i] = 0;
+            } else if (w.IsLeaf(i)) {
+                q.child[i] = 1u << 31 | unsigned(w.n_prims[i] - 1) << BVH4QNode::LEAF_FIRST_BITS |
+                    unsigned(w.child[i]);
+            } else {
+                q.child[i] = w.child[i];
+            }
+        }
+    }
+    nodes.clear();
+    nodes.shrink_to_fit();
+}
+
+const std::vector<int> &BVH4::GetIndices() const {
+    return indices;
+}
+
+void BVH4::UseLeafOrder() {
+    leaf_order = true;
+    indices.clear();
+    indices.shrink_to_fit();
+}
+
+gm::BBox BVH4::GetBBox() const {
+    return bbox;
+}
+
+bool BVH4::IsCompressed() const {
+    return !qnodes.empty();
+}
+
+size_t BVH4::GetMemory() const {
+    return nodes.capacity() * sizeof(BVH4Node) + qnodes.capacity() * sizeof(BVH4QNode) +
+        indices.capacity() * sizeof(int);
+}
+
+}
\ No newline at end of file
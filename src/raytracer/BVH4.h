@@ -0,0 +1,538 @@
+#pragma once
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PEPCY_BVH4_SSE
+#include <emmintrin.h>
+#endif
+
+#include <cstring>
+#include <limits>
+
+#include "BVHTree.h"
+
+namespace pepcy::renderer {
+
+template <int N>
+struct RayPacket;
+
+// 128-byte node of a 4-wide bvh, child boxes are stored per axis so that all
+// of them are tested against a ray at once, unused slots hold empty boxes
+struct alignas(16) BVH4Node {
+    int Count() const {
+        return n_children;
+    }
+    bool IsLeaf(int i) const {
+        return n_prims[i] > 0;
+    }
+    // interior: index of the child node, leaf: first primitive
+    int Child(int i) const {
+        return child[i];
+    }
+    int LeafSize(int i) const {
+        return n_prims[i];
+    }
+    void GetBounds(int i, float *lo, float *hi) const {
+        for (int d = 0; d < 3; d++) {
+            lo[d] = b_min[d][i];
+            hi[d] = b_max[d][i];
+        }
+    }
+
+    float b_min[3][4];
+    float b_max[3][4];
+    int child[4]; // interior: index of the child node, leaf: first primitive
+    unsigned short n_prims[4]; // 0 for interior children
+    int n_children;
+    int pad;
+};
+
+// 64-byte compressed node, child boxes are 8-bit offsets in a grid spanning
+// the bounds of the node, rounded outwards, so they are never smaller than
+// the boxes they are quantized from
+struct alignas(64) BVH4QNode {
+    // children are packed to the front, an empty slot has child 0
+    int Count() const {
+        int n = 0;
+        while (n < 4 && child[n] != 0) {
+            ++n;
+        }
+        return n;
+    }
+    bool IsLeaf(int i) const {
+        return child[i] >> 31;
+    }
+    int Child(int i) const {
+        return IsLeaf(i) ? child[i] & LEAF_FIRST_MASK : child[i];
+    }
+    int LeafSize(int i) const {
+        return (child[i] >> LEAF_FIRST_BITS & 31) + 1;
+    }
+    void GetBounds(int i, float *lo, float *hi) const {
+        for (int d = 0; d < 3; d++) {
+            lo[d] = origin[d] + q_min[d][i] * scale[d];
+            hi[d] = origin[d] + q_max[d][i] * scale[d];
+        }
+    }
+
+    float origin[3];
+    float scale[3];
+    unsigned char q_min[3][4];
+    unsigned char q_max[3][4];
+    // interior: index of the child node, which is never the root
+    // leaf: 1 bit flag, 5 bits size - 1, and 26 bits first primitive
+    unsigned int child[4];
+
+    static const int LEAF_FIRST_BITS = 26;
+    static const unsigned int LEAF_FIRST_MASK = (1u << LEAF_FIRST_BITS) - 1;
+};
+
+// 4-wide bvh collapsed from a binary BVHTree, primitives keep the indices of
+// the bounds the tree was built from
+class BVH4 {
+  public:
+    // compressed nodes take half the memory and are decoded during traversal,
+    // trees with more than 2^26 primitive references are never compressed
+    // leaves start at multiples of leaf_align in leaf order, the gaps are
+    // filled with -1 in the indices
+    void Build(const BVHTree &tree, bool compressed = false, int leaf_align = 1);
+
+    // same contracts as BVHTree::Intersect and BVHTree::Occluded
+    template <typename Func>
+    bool Intersect(const gm::Ray &r, Func &&func) const;
+    template <typename Func>
+    bool Occluded(const gm::Ray &r, Func &&func) const;
+
+    // packet versions, func(prim, mask) tests one primitive against the rays
+    // of p in mask and returns the mask of the rays it hit
+    // closest hit: func has to shrink the t_max of every ray it hits, the
+    // lanes that hit anything are returned
+    template <int N, typename Func>
+    uint32_t Intersect(RayPacket<N> &p, uint32_t mask, Func &&func) const;
+    // occlusion: the occluded lanes are returned
+    template <int N, typename Func>
+    uint32_t Occluded(RayPacket<N> &p, uint32_t mask, Func &&func) const;
+
+    // same as above, but func is passed whole leaves as ranges [first, first + n)
+    // of references in leaf order, func(first, n) and func(first, n, mask)
+    template <typename Func>
+    bool IntersectLeaves(const gm::Ray &r, Func &&func) const;
+    template <typename Func>
+    bool OccludedLeaves(const gm::Ray &r, Func &&func) const;
+    template <int N, typename Func>
+    uint32_t IntersectLeaves(RayPacket<N> &p, uint32_t mask, Func &&func) const;
+    template <int N, typename Func>
+    uint32_t OccludedLeaves(RayPacket<N> &p, uint32_t mask, Func &&func) const;
+
+    // primitives referenced by the leaves, in leaf order
+    const std::vector<int> &GetIndices() const;
+    // drops the indices, func is then passed the position of a reference in
+    // leaf order, for callers that store their primitives in that order
+    void UseLeafOrder();
+
+    gm::BBox GetBBox() const;
+    bool IsCompressed() const;
+    // bytes held by nodes and indices
+    size_t GetMemory() const;
+
+    static const int WIDTH = 4;
+    // a wide node is never deeper than the binary node it is collapsed from
+    static const int STACK_SIZE = (WIDTH - 1) * BVHTree::MAX_DEPTH + 1;
+
+  private:
+    int Collapse(const std::vector<BVHNode> &bin, int id);
+    void AlignLeaves(int align);
+    void Compress();
+    int Prim(int ref) const {
+        return leaf_order ? ref : indices[ref];
+    }
+
+    template <typename Node, typename Func>
+    bool IntersectNodes(const std::vector<Node> &nodes, const gm::Ray &r,
+        Func &func) const;
+    template <typename Node, typename Func>
+    bool OccludedNodes(const std::vector<Node> &nodes, const gm::Ray &r,
+        Func &func) const;
+    template <typename Node, int N, typename Func>
+    uint32_t IntersectNodes(const std::vector<Node> &nodes, RayPacket<N> &p,
+        uint32_t mask, Func &func) const;
+    template <typename Node, int N, typename Func>
+    uint32_t OccludedNodes(const std::vector<Node> &nodes, RayPacket<N> &p,
+        uint32_t mask, Func &func) const;
+
+    // returns the mask of children hit by the ray, and their entry distances
+    static int IntersectNode(const BVH4Node &u, const BVHRay &ray,
+        float t_min, float t_max, float *t);
+    static int IntersectNode(const BVH4QNode &u, const BVHRay &ray,
+        float t_min, float t_max, float *t);
+
+    std::vector<BVH4Node> nodes;
+    std::vector<BVH4QNode> qnodes; // used instead of nodes when compressed
+    std::vector<int> indices;
+    bool leaf_order = false;
+    gm::BBox bbox;
+};
+
+inline int BVH4::IntersectNode(const BVH4Node &u, const BVHRay &ray,
+        float t_min, float t_max, float *t) {
+    // near and far planes are picked by the sign of the direction, so empty
+    // slots are always missed, and a nan from 0 * inf keeps the old bound
+#ifdef PEPCY_BVH4_SSE
+    __m128 t0 = _mm_set1_ps(t_min);
+    __m128 t1 = _mm_set1_ps(t_max);
+    for (int d = 0; d < 3; d++) {
+        const float *p_near = ray.sign[d] ? u.b_max[d] : u.b_min[d];
+        const float *p_far = ray.sign[d] ? u.b_min[d] : u.b_max[d];
+        __m128 orig = _mm_set1_ps(ray.orig[d]);
+        __m128 inv_dir = _mm_set1_ps(ray.inv_dir[d]);
+        t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(p_near), orig), inv_dir), t0);
+        t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(p_far), orig), inv_dir), t1);
+    }
+    _mm_storeu_ps(t, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & ((1 << u.n_children) - 1);
+#else
+    int mask = 0;
+    for (int i = 0; i < u.n_children; i++) {
+        float t0 = t_min, t1 = t_max;
+        for (int d = 0; d < 3; d++) {
+            float p_near = ray.sign[d] ? u.b_max[d][i] : u.b_min[d][i];
+            float p_far = ray.sign[d] ? u.b_min[d][i] : u.b_max[d][i];
+            float tn = (p_near - ray.orig[d]) * ray.inv_dir[d];
+            float tf = (p_far - ray.orig[d]) * ray.inv_dir[d];
+            t0 = tn > t0 ? tn : t0;
+            t1 = tf < t1 ? tf : t1;
+        }
+        t[i] = t0;
+        if (t0 <= t1) {
+            mask |= 1 << i;
+        }
+    }
+    return mask;
+#endif
+}
+
+inline int BVH4::IntersectNode(const BVH4QNode &u, const BVHRay &ray,
+        float t_min, float t_max, float *t) {
+    // a plane at origin + q * scale is hit at q * (scale * inv_dir) +
+    // (origin - orig) * inv_dir, so decoding costs one multiply-add per plane
+#ifdef PEPCY_BVH4_SSE
+    __m128i zero = _mm_setzero_si128();
+    auto decode = [zero](const unsigned char *q) {
+        int bytes;
+        std::memcpy(&bytes, q, 4);
+        __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+        return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+    };
+    __m128 t0 = _mm_set1_ps(t_min);
+    __m128 t1 = _mm_set1_ps(t_max);
+    for (int d = 0; d < 3; d++) {
+        const unsigned char *q_near = ray.sign[d] ? u.q_max[d] : u.q_min[d];
+        const unsigned char *q_far = ray.sign[d] ? u.q_min[d] : u.q_max[d];
+        __m128 a = _mm_set1_ps(u.scale[d] * ray.inv_dir[d]);
+        __m128 b = _mm_set1_ps((u.origin[d] - ray.orig[d]) * ray.inv_dir[d]);
+        t0 = _mm_max_ps(_mm_add_ps(_mm_mul_ps(decode(q_near), a), b), t0);
+        t1 = _mm_min_ps(_mm_add_ps(_mm_mul_ps(decode(q_far), a), b), t1);
+    }
+    _mm_storeu_ps(t, t0);
+    __m128i empty = _mm_cmpeq_epi32(
+        _mm_load_si128(reinterpret_cast<const __m128i *>(u.child)), zero);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1)) &
+        ~_mm_movemask_ps(_mm_castsi128_ps(empty));
+#else
+    int mask = 0;
+    for (int i = 0; i < 4 && u.child[i] != 0; i++) {
+        float t0 = t_min, t1 = t_max;
+        for (int d = 0; d < 3; d++) {
+            float a = u.scale[d] * ray.inv_dir[d];
+            float b = (u.origin[d] - ray.orig[d]) * ray.inv_dir[d];
+            float q_near = ray.sign[d] ? u.q_max[d][i] : u.q_min[d][i];
+            float q_far = ray.sign[d] ? u.q_min[d][i] : u.q_max[d][i];
+            float tn = q_near * a + b;
+            float tf = q_far * a + b;
+            t0 = tn > t0 ? tn : t0;
+            t1 = tf < t1 ? tf : t1;
+        }
+        t[i] = t0;
+        if (t0 <= t1) {
+            mask |= 1 << i;
+        }
+    }
+    return mask;
+#endif
+}
+
+template <typename Func>
+bool BVH4::Intersect(const gm::Ray &r, Func &&func) const {
+    return IntersectLeaves(r, [this, &func](int first, int n) {
+        bool flag = false;
+        for (int i = 0; i < n; i++) {
+            if (func(Prim(first + i))) {
+                flag = true;
+            }
+        }
+        return flag;
+    });
+}
+
+template <typename Func>
+bool BVH4::Occluded(const gm::Ray &r, Func &&func) const {
+    return OccludedLeaves(r, [this, &func](int first, int n) {
+        for (int i = 0; i < n; i++) {
+            if (func(Prim(first + i))) {
+                return true;
+            }
+        }
+        return false;
+    });
+}
+
+template <int N, typename Func>
+uint32_t BVH4::Intersect(RayPacket<N> &p, uint32_t mask, Func &&func) const {
+    return IntersectLeaves(p, mask, [this, &func](int first, int n, uint32_t m) {
+        uint32_t hit = 0;
+        for (int i = 0; i < n; i++) {
+            hit |= func(Prim(first + i), m);
+        }
+        return hit;
+    });
+}
+
+template <int N, typename Func>
+uint32_t BVH4::Occluded(RayPacket<N> &p, uint32_t mask, Func &&func) const {
+    return OccludedLeaves(p, mask, [this, &func](int first, int n, uint32_t m) {
+        uint32_t occluded = 0;
+        for (int i = 0; i < n && m != 0; i++) {
+            uint32_t h = func(Prim(first + i), m);
+            occluded |= h;
+            m &= ~h;
+        }
+        return occluded;
+    });
+}
+
+template <typename Func>
+bool BVH4::IntersectLeaves(const gm::Ray &r, Func &&func) const {
+    return qnodes.empty() ? IntersectNodes(nodes, r, func) : IntersectNodes(qnodes, r, func);
+}
+
+template <typename Func>
+bool BVH4::OccludedLeaves(const gm::Ray &r, Func &&func) const {
+    return qnodes.empty() ? OccludedNodes(nodes, r, func) : OccludedNodes(qnodes, r, func);
+}
+
+template <int N, typename Func>
+uint32_t BVH4::IntersectLeaves(RayPacket<N> &p, uint32_t mask, Func &&func) const {
+    return qnodes.empty() ? IntersectNodes(nodes, p, mask, func) :
+        IntersectNodes(qnodes, p, mask, func);
+}
+
+template <int N, typename Func>
+uint32_t BVH4::OccludedLeaves(RayPacket<N> &p, uint32_t mask, Func &&func) const {
+    return qnodes.empty() ? OccludedNodes(nodes, p, mask, func) :
+        OccludedNodes(qnodes, p, mask, func);
+}
+
+template <typename Node, typename Func>
+bool BVH4::IntersectNodes(const std::vector<Node> &nodes, const gm::Ray &r,
+        Func &func) const {
+    if (nodes.empty()) {
+        return false;
+    }
+
+    // only children hit by the ray are pushed, with their entry distances,
+    // leaves are pushed as ~(node * 4 + slot)
+    struct Entry {
+        int e;
+        float t;
+    };
+    BVHRay ray(r);
+    bool flag = false;
+    Entry stack[STACK_SIZE];
+    int top = 0;
+    stack[top++] = { 0, r.t_min };
+    BVHCounterScope counters;
+    while (top > 0) {
+        Entry entry = stack[--top];
+        if (entry.t > r.t_max) continue;
+
+        int e = entry.e;
+        if (e < 0) {
+            const Node &u = nodes[~e >> 2];
+            int slot = ~e & 3;
+            if (func(u.Child(slot), u.LeafSize(slot))) {
+                flag = true;
+            }
+            continue;
+        }
+
+        const Node &u = nodes[e];
+        int n_children = u.Count();
+        ++counters.nodes;
+        counters.boxes += n_children;
+        float t[WIDTH];
+        int mask = IntersectNode(u, ray, r.t_min, r.t_max, t);
+        // sort hit children far to near, so the nearest one is popped first
+        int order[WIDTH];
+        int n = 0;
+        for (int i = 0; i < n_children; i++) {
+            if (mask >> i & 1) {
+                int j = n++;
+                for (; j > 0 && t[order[j - 1]] < t[i]; j--) {
+                    order[j] = order[j - 1];
+                }
+                order[j] = i;
+            }
+        }
+        for (int k = 0; k < n; k++) {
+            int i = order[k];
+            stack[top++] = { u.IsLeaf(i) ? ~(e * WIDTH + i) : u.Child(i), t[i] };
+        }
+    }
+    return flag;
+}
+
+template <typename Node, typename Func>
+bool BVH4::OccludedNodes(const std::vector<Node> &nodes, const gm::Ray &r,
+        Func &func) const {
+    if (nodes.empty()) {
+        return false;
+    }
+
+    BVHRay ray(r);
+    int stack[STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+    BVHCounterScope counters;
+    while (top > 0) {
+        const Node &u = nodes[stack[--top]];
+        int n_children = u.Count();
+        ++counters.nodes;
+        counters.boxes += n_children;
+        float t[WIDTH];
+        int mask = IntersectNode(u, ray, r.t_min, r.t_max, t);
+        for (int i = 0; i < n_children; i++) {
+            if (!(mask >> i & 1)) continue;
+            if (!u.IsLeaf(i)) {
+                stack[top++] = u.Child(i);
+                continue;
+            }
+            if (func(u.Child(i), u.LeafSize(i))) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+template <typename Node, int N, typename Func>
+uint32_t BVH4::IntersectNodes(const std::vector<Node> &nodes, RayPacket<N> &p,
+        uint32_t mask, Func &func) const {
+    if (nodes.empty() || mask == 0) {
+        return 0;
+    }
+
+    // nodes are pushed with the lanes that hit them and their nearest entry
+    struct Entry {
+        int e;
+        uint32_t mask;
+        float t;
+    };
+    uint32_t hit = 0;
+    Entry stack[STACK_SIZE];
+    int top = 0;
+    stack[top++] = { 0, mask, -std::numeric_limits<float>::max() };
+    BVHCounterScope counters;
+    while (top > 0) {
+        Entry entry = stack[--top];
+        if (entry.t > p.MaxT(entry.mask)) continue;
+
+        int e = entry.e;
+        if (e < 0) {
+            const Node &u = nodes[~e >> 2];
+            int slot = ~e & 3;
+            uint32_t h = func(u.Child(slot), u.LeafSize(slot), entry.mask);
+            for (int k = 0; k < N; k++) {
+                if (h >> k & 1) {
+                    p.t_max[k] = p.rays[k].t_max;
+                }
+            }
+            hit |= h;
+            continue;
+        }
+
+        const Node &u = nodes[e];
+        int n_children = u.Count();
+        int lanes = LaneCount(entry.mask);
+        counters.nodes += lanes;
+        counters.boxes += lanes * n_children;
+        Entry children[WIDTH];
+        int n = 0;
+        for (int i = 0; i < n_children; i++) {
+            float lo[3], hi[3];
+            u.GetBounds(i, lo, hi);
+            if (p.coherent && !p.MayHit(lo, hi)) continue;
+
+            float t;
+            uint32_t m = p.Intersect(lo, hi, entry.mask, t);
+            if (m == 0) continue;
+
+            // sorted far to near, so the nearest child is popped first
+            int j = n++;
+            for (; j > 0 && children[j - 1].t < t; j--) {
+                children[j] = children[j - 1];
+            }
+            children[j] = { u.IsLeaf(i) ? ~(e * WIDTH + i) : u.Child(i), m, t };
+        }
+        for (int k = 0; k < n; k++) {
+            stack[top++] = children[k];
+        }
+    }
+    return hit;
+}
+
+template <typename Node, int N, typename Func>
+uint32_t BVH4::OccludedNodes(const std::vector<Node> &nodes, RayPacket<N> &p,
+        uint32_t mask, Func &func) const {
+    if (nodes.empty() || mask == 0) {
+        return 0;
+    }
+
+    struct Entry {
+        int id;
+        uint32_t mask;
+    };
+    uint32_t occluded = 0;
+    Entry stack[STACK_SIZE];
+    int top = 0;
+    stack[top++] = { 0, mask };
+    BVHCounterScope counters;
+    while (top > 0) {
+        Entry entry = stack[--top];
+        const Node &u = nodes[entry.id];
+        int n_children = u.Count();
+        int lanes = LaneCount(entry.mask & ~occluded);
+        counters.nodes += lanes;
+        counters.boxes += lanes * n_children;
+        uint32_t active = entry.mask & ~occluded;
+        for (int i = 0; i < n_children && active != 0; i++) {
+            float lo[3], hi[3];
+            u.GetBounds(i, lo, hi);
+            if (p.coherent && !p.MayHit(lo, hi)) continue;
+
+            float t;
+            uint32_t m = p.Intersect(lo, hi, active, t);
+            if (m == 0) continue;
+            if (!u.IsLeaf(i)) {
+                stack[top++] = { u.Child(i), m };
+                continue;
+            }
+            occluded |= func(u.Child(i), u.LeafSize(i), m);
+            if (occluded == mask) {
+                return occluded;
+            }
+            active = entry.mask & ~occluded;
+        }
+    }
+    return occluded;
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,149 @@
+#include "BVHStats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <sstream>
+#include <unordered_set>
+
+namespace pepcy::renderer {
+
+void BVHStats::Add(const BVHStats &rhs) {
+    if (n_refs + rhs.n_refs > 0) {
+        sah_cost = (sah_cost * n_refs + rhs.sah_cost * rhs.n_refs) /
+            (n_refs + rhs.n_refs);
+    }
+    n_trees += rhs.n_trees;
+    n_nodes += rhs.n_nodes;
+    n_leaves += rhs.n_leaves;
+    n_prims += rhs.n_prims;
+    n_refs += rhs.n_refs;
+    max_depth = std::max(max_depth, rhs.max_depth);
+    depth_hist.resize(std::max(depth_hist.size(), rhs.depth_hist.size()));
+    for (int i = 0; i < rhs.depth_hist.size(); i++) {
+        depth_hist[i] += rhs.depth_hist[i];
+    }
+    leaf_size_hist.resize(std::max(leaf_size_hist.size(), rhs.leaf_size_hist.size()));
+    for (int i = 0; i < rhs.leaf_size_hist.size(); i++) {
+        leaf_size_hist[i] += rhs.leaf_size_hist[i];
+    }
+    memory += rhs.memory;
+    build_ms += rhs.build_ms;
+}
+
+static void WriteArray(std::ostream &out, const std::vector<int> &v) {
+    out << "[";
+    for (int i = 0; i < v.size(); i++) {
+        out << (i ? ", " : "") << v[i];
+    }
+    out << "]";
+}
+
+std::string BVHStats::ToJson() const {
+    std::ostringstream out;
+    out << "{ \"trees\": " << n_trees << ", \"nodes\": " << n_nodes <<
+        ", \"leaves\": " << n_leaves << ", \"prims\": " << n_prims <<
+        ", \"refs\": " << n_refs <<
+        ", \"max_depth\": " << max_depth << ", \"depth_hist\": ";
+    WriteArray(out, depth_hist);
+    out << ", \"leaf_size_hist\": ";
+    WriteArray(out, leaf_size_hist);
+    out << ", \"sah_cost\": " << sah_cost << ", \"memory\": " << memory <<
+        ", \"bytes_per_prim\": " << (n_prims > 0 ? double(memory) / n_prims : 0.0) <<
+        ", \"build_ms\": " << build_ms << " }";
+    return out.str();
+}
+
+std::string BVHCounters::ToJson() const {
+    std::ostringstream out;
+    out << "{ \"rays\": " << rays << ", \"nodes\": " << nodes <<
+        ", \"boxes\": " << boxes << ", \"instances\": " << instances <<
+        ", \"triangles\": " << triangles << " }";
+    return out.str();
+}
+
+namespace {
+
+// added to only by its own thread, but read and reset by others, adds are
+// atomic so a reset between the load and the store of one is not lost
+struct ThreadCounters {
+    ThreadCounters();
+    ~ThreadCounters();
+
+    std::atomic<uint64_t> rays = 0;
+    std::atomic<uint64_t> nodes = 0;
+    std::atomic<uint64_t> boxes = 0;
+    std::atomic<uint64_t> instances = 0;
+    std::atomic<uint64_t> triangles = 0;
+};
+
+std::atomic<bool> counters_enabled = false;
+std::mutex counters_mutex;
+std::unordered_set<ThreadCounters *> live_counters;
+BVHCounters retired_counters; // of threads that have exited
+
+void Add(std::atomic<uint64_t> &c, uint64_t v) {
+    c.fetch_add(v, std::memory_order_relaxed);
+}
+
+void AddTo(BVHCounters &sum, const ThreadCounters &c) {
+    sum.rays += c.rays.load(std::memory_order_relaxed);
+    sum.nodes += c.nodes.load(std::memory_order_relaxed);
+    sum.boxes += c.boxes.load(std::memory_order_relaxed);
+    sum.instances += c.instances.load(std::memory_order_relaxed);
+    sum.triangles += c.triangles.load(std::memory_order_relaxed);
+}
+
+ThreadCounters::ThreadCounters() {
+    std::lock_guard<std::mutex> lock(counters_mutex);
+    live_counters.insert(this);
+}
+
+ThreadCounters::~ThreadCounters() {
+    std::lock_guard<std::mutex> lock(counters_mutex);
+    AddTo(retired_counters, *this);
+    live_counters.erase(this);
+}
+
+thread_local ThreadCounters thread_counters;
+
+}
+
+void EnableBVHCounters(bool enable) {
+    counters_enabled.store(enable, std::memory_order_relaxed);
+}
+
+bool BVHCountersEnabled() {
+    return counters_enabled.load(std::memory_order_relaxed);
+}
+
+BVHCounters GetBVHCounters() {
+    std::lock_guard<std::mutex> lock(counters_mutex);
+    BVHCounters sum = retired_counters;
+    for (auto c : live_counters) {
+        AddTo(sum, *c);
+    }
+    return sum;
+}
+
+void ResetBVHCounters() {
+    std::lock_guard<std::mutex> lock(counters_mutex);
+    retired_counters = BVHCounters();
+    for (auto c : live_counters) {
+        c->rays = c->nodes = c->boxes = c->instances = c->triangles = 0;
+    }
+}
+
+BVHCounterScope::~BVHCounterScope() {
+    if (!BVHCountersEnabled()) {
+        return;
+    }
+    ThreadCounters &c = thread_counters;
+    Add(c.rays, rays);
+    Add(c.nodes, nodes);
+    Add(c.boxes, boxes);
+    Add(c.instances, instances);
+    Add(c.triangles, triangles);
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace pepcy::renderer {
+
+// quality of one or several built bvhs
+struct BVHStats {
+    // merges the stats of another tree, the sah cost is averaged weighted by
+    // the number of primitive references
+    void Add(const BVHStats &rhs);
+    std::string ToJson() const;
+
+    int n_trees = 0;
+    int n_nodes = 0;
+    int n_leaves = 0;
+    int n_prims = 0;
+    int n_refs = 0; // primitive references in leaves, duplicates included
+    int max_depth = 0;
+    std::vector<int> depth_hist; // number of leaves at each depth
+    std::vector<int> leaf_size_hist; // number of leaves of each size
+    float sah_cost = 0.0f;
+    size_t memory = 0; // bytes, including the primitives if a tree owns them
+    double build_ms = 0.0;
+};
+
+// traversal work summed over all threads
+struct BVHCounters {
+    std::string ToJson() const;
+
+    uint64_t rays = 0;
+    uint64_t nodes = 0; // nodes visited
+    uint64_t boxes = 0; // child boxes tested
+    uint64_t instances = 0; // instances entered
+    uint64_t triangles = 0; // triangles tested
+};
+
+// counters are only collected while enabled, each thread adds to its own
+// counters, which are merged when they are read or the thread exits
+void EnableBVHCounters(bool enable);
+bool BVHCountersEnabled();
+BVHCounters GetBVHCounters();
+void ResetBVHCounters();
+
+// number of rays in a packet mask, packet traversals count work per ray
+inline int LaneCount(uint32_t mask) {
+#if defined(__GNUC__)
+    return __builtin_popcount(mask);
+#else
+    int n = 0;
+    for (; mask != 0; mask &= mask - 1) {
+        ++n;
+    }
+    return n;
+#endif
+}
+
+// counts the work of one traversal in locals, and adds it to the counters of
+// the calling thread when it goes out of scope
+struct BVHCounterScope {
+    ~BVHCounterScope();
+
+    uint64_t rays = 0;
+    uint64_t nodes = 0;
+    uint64_t boxes = 0;
+    uint64_t instances = 0;
+    uint64_t triangles = 0;
+};
+
+}
\ No newline at end of file
@@ -1,222 +1,1109 @@
 #include "BVHTree.h"
 
-#include <queue>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
 #include <stack>
+#include <thread>
 
 namespace pepcy::renderer {
 
-BVHNode::BVHNode(const gm::BBox &bbox, int start, int len) : bbox(bbox), 
-        start(start), len(len), lc(), rc() {}
+// sah costs of a traversal step and of a primitive test
+static const float traversal_cost = 0.125f;
+static const float intersect_cost = 1.0f;
 
-bool BVHNode::IsLeaf() const {
-    return !lc && !rc;
+// leaf size of the linear builders, which cannot evaluate the sah per node,
+// unless max_leaf_size is smaller
+static const int lbvh_leaf_size = 4;
+// number of leading morton bits that select the treelet of a primitive
+static const int treelet_bits = 12;
+
+using Clock = std::chrono::steady_clock;
+using Milliseconds = std::chrono::duration<double, std::milli>;
+
+// nodes with at least this many primitives are binned by the task pool
+static const int parallel_bin_size = 1 << 16;
+// subtrees with at least this many primitives are built as separate tasks
+static const int parallel_build_size = 1 << 12;
+
+struct BVHTree::Bins {
+    void Merge(const Bins &rhs);
+
+    gm::BBox boxes[3][MAX_BINS];
+    gm::BBox cboxes[3][MAX_BINS]; // bounds of the centroids in each bin
+    int counts[3][MAX_BINS] = {};
+};
+
+void BVHTree::Bins::Merge(const Bins &rhs) {
+    for (int d = 0; d < 3; d++) {
+        for (int i = 0; i < MAX_BINS; i++) {
+            boxes[d][i].Expand(rhs.boxes[d][i]);
+            cboxes[d][i].Expand(rhs.cboxes[d][i]);
+            counts[d][i] += rhs.counts[d][i];
+        }
+    }
 }
 
-void BVHTree::Build(const std::vector<Primitive *> &prims_) {
-    prims = prims_;
+// appends two subtrees built in separate arrays in depth-first order,
+// returns the index of the second one
+static int Splice(std::vector<BVHNode> &out, const std::vector<BVHNode> &left,
+        const std::vector<BVHNode> &right) {
+    int lc = out.size();
+    for (auto node : left) {
+        if (!node.IsLeaf()) node.offset += lc;
+        out.push_back(node);
+    }
+    int rc = out.size();
+    for (auto node : right) {
+        if (!node.IsLeaf()) node.offset += rc;
+        out.push_back(node);
+    }
+    return rc;
+}
 
-    gm::BBox bbox;
-    for (int i = 0; i < prims.size(); i++) {
-        bbox.Expand(prims[i]->GetBBox());
+// a fixed pool of helper threads shared by all builds, so that loops run
+// from several subtree tasks at once do not start threads of their own
+// a caller runs queued tasks, of its own loop or of others, while it waits,
+// so loops nested in the tasks of another one never wait on each other
+class TaskPool {
+  public:
+    static TaskPool &Get() {
+        static TaskPool pool;
+        return pool;
     }
-    root = std::make_shared<BVHNode>(bbox, 0, prims.size());
 
-    std::queue<std::shared_ptr<BVHNode>> q;
-    q.push(root);
-    static const int max_leaf_size = 32;
-    static const int B = 16;
-    while (!q.empty()) {
-        auto u = q.front();
-        q.pop();
-        if (u->len <= max_leaf_size) {
-            continue;
+    // calls func(t) for t in [0, n_tasks) and blocks until all of them return
+    void Run(int n_tasks, const std::function<void(int)> &func) {
+        if (n_tasks <= 1 || threads.empty()) {
+            for (int t = 0; t < n_tasks; t++) {
+                func(t);
+            }
+            return;
         }
+        Job job { &func, n_tasks };
+        std::unique_lock<std::mutex> lock(mutex);
+        jobs.push_back(&job);
+        cv.notify_all();
+        while (job.n_done < n_tasks) {
+            if (!RunOne(lock)) {
+                cv.wait(lock);
+            }
+        }
+    }
 
-        int best_d = -1, best_i = -1;
-        float SN = u->bbox.SurfaceArea();
-        float best_c = std::numeric_limits<float>::max();
+  private:
+    struct Job {
+        const std::function<void(int)> *func;
+        int n_tasks;
+        int next = 0;
+        int n_done = 0;
+    };
 
-        for (int d = 0; d < 3; d++) {
-            std::vector<gm::BBox> boxes(B);
-            std::vector<std::vector<Primitive *>> prims_tmp(B);
-            float min = u->bbox.p_min[d], max = u->bbox.p_max[d];
-            float length = (max - min) / B;
-            if (length == 0) continue;
-
-            for (int i = 0; i < u->len; i++) {
-                gm::BBox cb = prims[u->start + i]->GetBBox();
-                float p = cb.Centroid()[d];
-                int buc = std::clamp<int>((p - min) / length, 0, B - 1);
-                prims_tmp[buc].push_back(prims[u->start + i]);
-                boxes[buc].Expand(cb);
-            }
-
-            for (int i = 1; i < B; i++) {
-                gm::BBox lb, rb;
-                int ln = 0, rn = 0;
-                for (int j = 0; j < i; j++) {
-                    lb.Expand(boxes[j]);
-                    ln += prims_tmp[j].size();
-                }
-                for (int j = i; j < B; j++) {
-                    rb.Expand(boxes[j]);
-                    rn += prims_tmp[j].size();
-                }
-                float SA = lb.SurfaceArea(), SB = rb.SurfaceArea();
-                float C = SA / SN * ln + SB / SN * rn;
-                if (C < best_c) {
-                    best_d = d;
-                    best_i = i;
-                    best_c = C;
+    TaskPool() {
+        int n_threads = std::max<int>(std::thread::hardware_concurrency(), 1);
+        for (int i = 1; i < n_threads; i++) {
+            threads.emplace_back([this]() {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (!quit) {
+                    if (!RunOne(lock)) {
+                        cv.wait(lock);
+                    }
                 }
-            }
+            });
         }
+    }
 
-        float min = u->bbox.p_min[best_d], max = u->bbox.p_max[best_d];
-        float length = (max - min) / B;
-        gm::BBox lb, rb;
-        std::vector<Primitive *> lp, rp;
-        for (int i = 0; i < u->len; i++) {
-            gm::BBox cb = prims[u->start + i]->GetBBox();
-            float p = cb.Centroid()[best_d];
-            int buc = std::clamp<int>((p - min) / length, 0, B - 1);
-            if (buc < best_i) {
-                lb.Expand(cb);
-                lp.push_back(prims[u->start + i]);
-            } else {
-                rb.Expand(cb);
-                rp.push_back(prims[u->start + i]);
-            }
+    ~TaskPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        cv.notify_all();
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+
+    // takes the next task of the oldest job and runs it unlocked, false if no
+    // task is queued
+    bool RunOne(std::unique_lock<std::mutex> &lock) {
+        if (jobs.empty()) {
+            return false;
+        }
+        Job *job = jobs.front();
+        int t = job->next++;
+        if (job->next == job->n_tasks) {
+            jobs.pop_front();
+        }
+        lock.unlock();
+        (*job->func)(t);
+        lock.lock();
+        if (++job->n_done == job->n_tasks) {
+            cv.notify_all();
+        }
+        return true;
+    }
+
+    std::vector<std::thread> threads;
+    std::deque<Job *> jobs;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool quit = false;
+};
+
+static void ParallelFor(int n_tasks, const std::function<void(int)> &func) {
+    TaskPool::Get().Run(n_tasks, func);
+}
+
+int BVHTree::BinIndex(float c, float min, float scale) const {
+    return std::clamp<int>((c - min) * scale, 0, params.n_bins - 1);
+}
+
+void BVHTree::SetParams(const BVHBuildParams &params) {
+    this->params = params;
+    this->params.max_leaf_size = std::clamp(params.max_leaf_size, 1, 0xffff);
+    this->params.n_bins = std::clamp(params.n_bins, 2, MAX_BINS);
+    this->params.prim_block = std::max(params.prim_block, 1);
+}
+
+float BVHTree::LeafCost(int n) const {
+    return intersect_cost * ((n + params.prim_block - 1) / params.prim_block);
+}
+
+int BVHTree::MedianDepth(int len) const {
+    int depth = 0;
+    while (len > params.max_leaf_size) {
+        len -= len / 2;
+        ++depth;
+    }
+    return depth;
+}
+
+void BVHTree::Build(const std::vector<gm::BBox> &bounds, BVHBuildMethod method,
+        const BVHBuildParams &params) {
+    auto start = Clock::now();
+    SetParams(params);
+    nodes.clear();
+    indices.clear();
+    build_ms = 0.0;
+    n_prims = bounds.size();
+    if (bounds.empty()) {
+        return;
+    }
+
+    n_threads = std::max<int>(std::thread::hardware_concurrency(), 1);
+    task_depth = 0;
+    while ((1 << task_depth) < 2 * n_threads) {
+        ++task_depth;
+    }
+
+    // bounds and centroids are fetched once, the build only touches refs
+    int N = bounds.size();
+    refs.resize(N);
+    gm::BBox bbox, cbox;
+    for (int i = 0; i < N; i++) {
+        refs[i].bbox = bounds[i];
+        refs[i].centroid = refs[i].bbox.Centroid();
+        refs[i].index = i;
+        bbox.Expand(refs[i].bbox);
+        cbox.Expand(refs[i].centroid);
+    }
+    if (method == BVHBuildMethod::SAH || method == BVHBuildMethod::SBVH) {
+        nodes.reserve(2 * N / params.max_leaf_size + 1);
+        BuildRecursive(nodes, 0, N, bbox, cbox, 0);
+    } else {
+        nodes.reserve(2 * N / std::min(lbvh_leaf_size, params.max_leaf_size) + 1);
+        BuildLinear(cbox, method == BVHBuildMethod::HLBVH);
+    }
+    FinishBuild();
+    build_ms = Milliseconds(Clock::now() - start).count();
+}
+
+void BVHTree::FinishBuild() {
+    indices.resize(refs.size());
+    for (int i = 0; i < refs.size(); i++) {
+        indices[i] = refs[i].index;
+    }
+    refs.clear();
+    refs.shrink_to_fit();
+    codes.clear();
+    codes.shrink_to_fit();
+}
+
+void BVHTree::ComputeBins(const BVHBuildRef *rs, int len, const gm::BBox &cbox,
+        Bins &bins) const {
+    for (int d = 0; d < 3; d++) {
+        float min = cbox.p_min[d], max = cbox.p_max[d];
+        if (max <= min) continue;
+
+        float scale = params.n_bins / (max - min);
+        for (int i = 0; i < len; i++) {
+            int buc = BinIndex(rs[i].centroid[d], min, scale);
+            ++bins.counts[d][buc];
+            bins.boxes[d][buc].Expand(rs[i].bbox);
+            bins.cboxes[d][buc].Expand(rs[i].centroid);
         }
+    }
+}
 
-        if (lp.size() == 0 || lp.size() == u->len) {
-            lb = gm::BBox();
-            rb = gm::BBox();
-            int hn = u->len / 2;
-            for (int i = 0; i < hn; i++) {
-                lb.Expand(prims[u->start + i]->GetBBox());
+void BVHTree::SweepBins(const Bins &bins, const gm::BBox &bbox,
+        const gm::BBox &cbox, int &best_d, int &best_i, float &best_c) const {
+    // prefix sweep for the left sides, suffix sweep for the right sides
+    float inv_sn = 1.0f / std::max(bbox.SurfaceArea(),
+        std::numeric_limits<float>::min());
+    for (int d = 0; d < 3; d++) {
+        if (cbox.p_max[d] <= cbox.p_min[d]) continue;
+
+        float l_area[MAX_BINS];
+        int l_count[MAX_BINS];
+        gm::BBox lb;
+        int ln = 0;
+        for (int i = 0; i < params.n_bins - 1; i++) {
+            lb.Expand(bins.boxes[d][i]);
+            ln += bins.counts[d][i];
+            l_area[i] = lb.SurfaceArea();
+            l_count[i] = ln;
+        }
+        gm::BBox rb;
+        int rn = 0;
+        for (int i = params.n_bins - 1; i > 0; i--) {
+            rb.Expand(bins.boxes[d][i]);
+            rn += bins.counts[d][i];
+            if (l_count[i - 1] == 0 || rn == 0) continue;
+
+            float C = traversal_cost + inv_sn *
+                (l_area[i - 1] * LeafCost(l_count[i - 1]) + rb.SurfaceArea() * LeafCost(rn));
+            if (C < best_c) {
+                best_d = d;
+                best_i = i;
+                best_c = C;
             }
-            for (int i = hn; i < u->len; i++) {
-                rb.Expand(prims[u->start + i]->GetBBox());
+        }
+    }
+}
+
+int BVHTree::BuildRecursive(std::vector<BVHNode> &out, int start, int len,
+        const gm::BBox &bbox, const gm::BBox &cbox, int depth) {
+    int id = out.size();
+    out.emplace_back();
+    out[id].bbox = bbox;
+    out[id].axis = 0;
+
+    int best_d = -1, best_i = -1;
+    float best_c = std::numeric_limits<float>::max();
+
+    // below half of the max depth only median splits are used, so the depth
+    // of the whole tree always fits in the fixed traversal stack
+    Bins bins;
+    if (len > 1 && depth < MAX_DEPTH / 2) {
+        if (len >= parallel_bin_size && n_threads > 1) {
+            // each task bins a contiguous chunk, merged in a fixed order
+            int chunk = (len + n_threads - 1) / n_threads;
+            int n_chunks = (len + chunk - 1) / chunk;
+            std::vector<Bins> chunk_bins(n_chunks);
+            ParallelFor(n_chunks, [&](int t) {
+                int cs = start + t * chunk;
+                ComputeBins(refs.data() + cs, std::min(chunk, start + len - cs), cbox,
+                    chunk_bins[t]);
+            });
+            for (int t = 0; t < n_chunks; t++) {
+                bins.Merge(chunk_bins[t]);
             }
-            u->lc = std::make_shared<BVHNode>(lb, u->start, hn);
-            u->rc = std::make_shared<BVHNode>(rb, u->start + hn, u->len - hn);
-            q.push(u->lc);
-            q.push(u->rc);
         } else {
-            int p = 0;
-            for (auto prim : lp) {
-                prims[u->start + p] = prim;
-                ++p;
+            ComputeBins(refs.data() + start, len, cbox, bins);
+        }
+
+        SweepBins(bins, bbox, cbox, best_d, best_i, best_c);
+    }
+
+    if (len <= params.max_leaf_size && (best_d == -1 || LeafCost(len) <= best_c)) {
+        out[id].offset = start;
+        out[id].n_prims = len;
+        return id;
+    }
+    out[id].n_prims = 0;
+
+    int ln;
+    gm::BBox lb, rb, lcb, rcb;
+    if (best_d != -1) {
+        for (int i = 0; i < params.n_bins; i++) {
+            if (i < best_i) {
+                lb.Expand(bins.boxes[best_d][i]);
+                lcb.Expand(bins.cboxes[best_d][i]);
+            } else {
+                rb.Expand(bins.boxes[best_d][i]);
+                rcb.Expand(bins.cboxes[best_d][i]);
             }
-            int ln = p;
-            for (auto prim : rp) {
-                prims[u->start + p] = prim;
-                ++p;
+        }
+        float min = cbox.p_min[best_d];
+        float scale = params.n_bins / (cbox.p_max[best_d] - min);
+        auto mid = std::partition(refs.begin() + start, refs.begin() + start + len,
+            [this, best_d, best_i, min, scale](const BVHBuildRef &ref) {
+                return BinIndex(ref.centroid[best_d], min, scale) < best_i;
+            });
+        ln = mid - (refs.begin() + start);
+        out[id].axis = best_d;
+    } else {
+        // all centroids coincide or the depth limit is reached
+        int d = cbox.MaxExtent();
+        ln = len / 2;
+        std::nth_element(refs.begin() + start, refs.begin() + start + ln,
+            refs.begin() + start + len,
+            [d](const BVHBuildRef &a, const BVHBuildRef &b) {
+                return a.centroid[d] < b.centroid[d];
+            });
+        for (int i = start; i < start + len; i++) {
+            if (i < start + ln) {
+                lb.Expand(refs[i].bbox);
+                lcb.Expand(refs[i].centroid);
+            } else {
+                rb.Expand(refs[i].bbox);
+                rcb.Expand(refs[i].centroid);
             }
-            u->lc = std::make_shared<BVHNode>(lb, u->start, ln);
-            u->rc = std::make_shared<BVHNode>(rb, u->start + ln, u->len - ln);
-            q.push(u->lc);
-            q.push(u->rc);
         }
+        out[id].axis = d;
+    }
+
+    if (depth < task_depth && len >= parallel_build_size) {
+        // both subtrees work on disjoint primitive ranges, so the left one is
+        // built by another thread into its own array and spliced back in
+        // depth-first order, which gives the same tree as the serial build
+        std::vector<BVHNode> left;
+        auto handle = std::async(std::launch::async,
+            [this, &left, start, ln, &lb, &lcb, depth]() {
+                BuildRecursive(left, start, ln, lb, lcb, depth + 1);
+            });
+        std::vector<BVHNode> right;
+        BuildRecursive(right, start + ln, len - ln, rb, rcb, depth + 1);
+        handle.get();
+        out[id].offset = Splice(out, left, right);
+    } else {
+        BuildRecursive(out, start, ln, lb, lcb, depth + 1);
+        out[id].offset = BuildRecursive(out, start + ln, len - ln, rb, rcb, depth + 1);
     }
+    return id;
 }
 
-bool BVHTree::Intersect(const gm::Ray &r) const {
-    bool flag = false;
-    std::stack<std::shared_ptr<BVHNode>> s;
-    s.push(root);
-    while (!s.empty()) {
-        auto u = s.top();
-        s.pop();
+// spatial splits are only tried where the children of the best object split
+// overlap by more than this fraction of the root area
+static const float spatial_split_alpha = 1e-5f;
 
-        float t0, t1;
-        if (u->bbox.Intersect(r, t0, t1)) {
-            if (u->IsLeaf()) {
-                for (int i = 0; i < u->len; i++) {
-                    if (prims[u->start + i]->Intersect(r)) {
-                        flag = true;
-                        break;
-                    }
-                }
-                if (flag) break;
-            } else {
-                if (u->lc) s.push(u->lc);
-                if (u->rc) s.push(u->rc);
+struct BVHTree::SpatialBins {
+    gm::BBox boxes[3][MAX_BINS];
+    int enters[3][MAX_BINS] = {};
+    int exits[3][MAX_BINS] = {};
+};
+
+static gm::BBox Overlap(const gm::BBox &a, const gm::BBox &b) {
+    gm::BBox ret;
+    ret.p_min = Max(a.p_min, b.p_min);
+    ret.p_max = Min(a.p_max, b.p_max);
+    return ret.IsEmpty() ? gm::BBox() : ret;
+}
+
+void BVHTree::BuildSpatial(const std::vector<gm::Vector3> &points,
+        const BVHBuildParams &params) {
+    auto start = Clock::now();
+    SetParams(params);
+    nodes.clear();
+    indices.clear();
+    build_ms = 0.0;
+    int N = points.size() / 3;
+    n_prims = N;
+    if (N == 0) {
+        return;
+    }
+
+    n_threads = std::max<int>(std::thread::hardware_concurrency(), 1);
+    task_depth = 0;
+    while ((1 << task_depth) < 2 * n_threads) {
+        ++task_depth;
+    }
+    this->points = &points;
+
+    std::vector<BVHBuildRef> rs(N);
+    gm::BBox bbox;
+    for (int i = 0; i < N; i++) {
+        rs[i].bbox = gm::BBox();
+        for (int k = 0; k < 3; k++) {
+            rs[i].bbox.Expand(points[3 * i + k]);
+        }
+        rs[i].centroid = rs[i].bbox.Centroid();
+        rs[i].index = i;
+        bbox.Expand(rs[i].bbox);
+    }
+    root_area = bbox.SurfaceArea();
+
+    // leaves append their references to refs in depth-first order
+    refs.reserve(N);
+    nodes.reserve(2 * N / params.max_leaf_size + 1);
+    BuildSpatialRecursive(nodes, refs, rs, bbox, int(N * params.max_duplication), 0);
+    this->points = nullptr;
+    FinishBuild();
+    build_ms = Milliseconds(Clock::now() - start).count();
+}
+
+// bounds of the part of a reference between the planes lo and hi along d
+gm::BBox BVHTree::ClipRef(const BVHBuildRef &ref, int d, float lo,
+        float hi) const {
+    const gm::Vector3 *p = points->data() + 3 * ref.index;
+    gm::BBox box;
+    for (int k = 0; k < 3; k++) {
+        const gm::Vector3 &a = p[k];
+        const gm::Vector3 &b = p[(k + 1) % 3];
+        if (a[d] >= lo && a[d] <= hi) {
+            box.Expand(a);
+        }
+        for (float plane : { lo, hi }) {
+            if ((a[d] < plane && b[d] > plane) || (a[d] > plane && b[d] < plane)) {
+                gm::Vector3 q = a + (b - a) * ((plane - a[d]) / (b[d] - a[d]));
+                q[d] = plane;
+                box.Expand(q);
             }
         }
     }
-    return flag;
+    // a reference may already be clipped by splits above
+    return Overlap(box, ref.bbox);
 }
-bool BVHTree::Intersect(const gm::Ray &r, Intersection &inter) const {
-    bool flag = false;
-    std::stack<std::shared_ptr<BVHNode>> s;
-    s.push(root);
-    while (!s.empty()) {
-        auto u = s.top();
-        s.pop();
 
-        float t0, t1;
-        if (u->bbox.Intersect(r, t0, t1)) {
-            if (u->IsLeaf()) {
-                for (int i = 0; i < u->len; i++) {
-                    if (prims[u->start + i]->Intersect(r, inter)) {
-                        flag = true;
-                    }
-                }
+void BVHTree::SweepSpatialBins(const std::vector<BVHBuildRef> &rs,
+        const gm::BBox &bbox, int budget, int &best_d, int &best_i, float &best_c) const {
+    SpatialBins bins;
+    float inv_sn = 1.0f / std::max(bbox.SurfaceArea(),
+        std::numeric_limits<float>::min());
+    for (int d = 0; d < 3; d++) {
+        float min = bbox.p_min[d], max = bbox.p_max[d];
+        if (max <= min) continue;
+
+        float scale = params.n_bins / (max - min);
+        float width = (max - min) / params.n_bins;
+        for (const BVHBuildRef &ref : rs) {
+            int lo = BinIndex(ref.bbox.p_min[d], min, scale);
+            int hi = BinIndex(ref.bbox.p_max[d], min, scale);
+            ++bins.enters[d][lo];
+            ++bins.exits[d][hi];
+            if (lo == hi) {
+                bins.boxes[d][lo].Expand(ref.bbox);
+                continue;
+            }
+            for (int i = lo; i <= hi; i++) {
+                float b0 = i == lo ? ref.bbox.p_min[d] : min + i * width;
+                float b1 = i == hi ? ref.bbox.p_max[d] : min + (i + 1) * width;
+                bins.boxes[d][i].Expand(ClipRef(ref, d, b0, b1));
+            }
+        }
+
+        // references that entered left of a plane but did not exit there
+        // straddle it, planes that would duplicate more than budget of them
+        // are skipped
+        float l_area[MAX_BINS];
+        int l_count[MAX_BINS];
+        int l_straddle[MAX_BINS];
+        gm::BBox lb;
+        int ln = 0, l_exits = 0;
+        for (int i = 0; i < params.n_bins - 1; i++) {
+            lb.Expand(bins.boxes[d][i]);
+            ln += bins.enters[d][i];
+            l_exits += bins.exits[d][i];
+            l_area[i] = lb.SurfaceArea();
+            l_count[i] = ln;
+            l_straddle[i] = ln - l_exits;
+        }
+        gm::BBox rb;
+        int rn = 0;
+        for (int i = params.n_bins - 1; i > 0; i--) {
+            rb.Expand(bins.boxes[d][i]);
+            rn += bins.exits[d][i];
+            if (l_count[i - 1] == 0 || rn == 0 || l_straddle[i - 1] > budget) continue;
+
+            float C = traversal_cost + inv_sn *
+                (l_area[i - 1] * LeafCost(l_count[i - 1]) + rb.SurfaceArea() * LeafCost(rn));
+            if (C < best_c) {
+                best_d = d;
+                best_i = i;
+                best_c = C;
+            }
+        }
+    }
+}
+
+int BVHTree::BuildSpatialRecursive(std::vector<BVHNode> &out,
+        std::vector<BVHBuildRef> &out_refs, std::vector<BVHBuildRef> &rs,
+        const gm::BBox &bbox, int budget, int depth) {
+    int len = rs.size();
+    gm::BBox cbox;
+    for (const BVHBuildRef &ref : rs) {
+        cbox.Expand(ref.centroid);
+    }
+
+    int id = out.size();
+    out.emplace_back();
+    out[id].bbox = bbox;
+    out[id].axis = 0;
+
+    int best_d = -1, best_i = -1;
+    float best_c = std::numeric_limits<float>::max();
+    Bins bins;
+    gm::BBox lb, rb;
+    // only median splits below half of the max depth, as in BuildRecursive
+    if (len > 1 && depth < MAX_DEPTH / 2) {
+        ComputeBins(rs.data(), len, cbox, bins);
+        SweepBins(bins, bbox, cbox, best_d, best_i, best_c);
+    }
+    if (best_d != -1) {
+        for (int i = 0; i < params.n_bins; i++) {
+            (i < best_i ? lb : rb).Expand(bins.boxes[best_d][i]);
+        }
+    }
+
+    int split_d = -1, split_i = -1;
+    float split_c = std::numeric_limits<float>::max();
+    bool overlapped = best_d == -1 ||
+        Overlap(lb, rb).SurfaceArea() > spatial_split_alpha * root_area;
+    if (len > 1 && depth < MAX_DEPTH / 2 && budget > 0 && overlapped) {
+        SweepSpatialBins(rs, bbox, budget, split_d, split_i, split_c);
+        if (split_c >= best_c) {
+            split_d = -1;
+        }
+    }
+
+    float min_c = std::min(best_c, split_c);
+    if (len <= params.max_leaf_size && ((best_d == -1 && split_d == -1) ||
+            LeafCost(len) <= min_c)) {
+        out[id].offset = out_refs.size();
+        out[id].n_prims = len;
+        out_refs.insert(out_refs.end(), rs.begin(), rs.end());
+        return id;
+    }
+    out[id].n_prims = 0;
+
+    std::vector<BVHBuildRef> left, right;
+    if (split_d != -1) {
+        int d = split_d;
+        float min = bbox.p_min[d];
+        float scale = params.n_bins / (bbox.p_max[d] - min);
+        float pos = min + split_i * (bbox.p_max[d] - min) / params.n_bins;
+        // counts and bounds of both sides with every straddling reference
+        // split, each of them is then kept whole on one side if that is
+        // cheaper than splitting it
+        gm::BBox l_box, r_box;
+        int ln = 0, rn = 0;
+        std::vector<int> straddle;
+        for (int k = 0; k < len; k++) {
+            int lo = BinIndex(rs[k].bbox.p_min[d], min, scale);
+            int hi = BinIndex(rs[k].bbox.p_max[d], min, scale);
+            if (hi < split_i) {
+                l_box.Expand(rs[k].bbox);
+                ++ln;
+            } else if (lo >= split_i) {
+                r_box.Expand(rs[k].bbox);
+                ++rn;
             } else {
-                if (u->lc) s.push(u->lc);
-                if (u->rc) s.push(u->rc);
-                float lt0, lt1;
-                bool flag_l = false;
-                if (u->lc) {
-                    flag_l = u->lc->bbox.Intersect(r, lt0, lt1);
+                straddle.push_back(k);
+                l_box.Expand(ClipRef(rs[k], d, rs[k].bbox.p_min[d], pos));
+                r_box.Expand(ClipRef(rs[k], d, pos, rs[k].bbox.p_max[d]));
+                ++ln;
+                ++rn;
+            }
+        }
+        // 0: split, 1: kept whole on the left, 2: kept whole on the right
+        std::vector<char> side(len, 0);
+        for (int k : straddle) {
+            float c_split = l_box.SurfaceArea() * ln + r_box.SurfaceArea() * rn;
+            float c_left = Combine(l_box, rs[k].bbox).SurfaceArea() * ln +
+                r_box.SurfaceArea() * (rn - 1);
+            float c_right = l_box.SurfaceArea() * (ln - 1) +
+                Combine(r_box, rs[k].bbox).SurfaceArea() * rn;
+            if (c_left < c_split && c_left <= c_right) {
+                side[k] = 1;
+                l_box.Expand(rs[k].bbox);
+                --rn;
+            } else if (c_right < c_split) {
+                side[k] = 2;
+                r_box.Expand(rs[k].bbox);
+                --ln;
+            }
+        }
+        for (int k = 0; k < len; k++) {
+            int lo = BinIndex(rs[k].bbox.p_min[d], min, scale);
+            int hi = BinIndex(rs[k].bbox.p_max[d], min, scale);
+            if (hi < split_i) {
+                left.push_back(rs[k]);
+            } else if (lo >= split_i) {
+                right.push_back(rs[k]);
+            } else if (side[k] == 1) {
+                left.push_back(rs[k]);
+            } else if (side[k] == 2) {
+                right.push_back(rs[k]);
+            } else {
+                BVHBuildRef l = rs[k], r = rs[k];
+                l.bbox = ClipRef(rs[k], d, rs[k].bbox.p_min[d], pos);
+                r.bbox = ClipRef(rs[k], d, pos, rs[k].bbox.p_max[d]);
+                if (!l.bbox.IsEmpty()) {
+                    l.centroid = l.bbox.Centroid();
+                    left.push_back(l);
+                }
+                if (!r.bbox.IsEmpty()) {
+                    r.centroid = r.bbox.Centroid();
+                    right.push_back(r);
                 }
-                float rt0, rt1;
-                bool flag_r = false;
-                if (u->rc) {
-                    flag_r = u->rc->bbox.Intersect(r, rt0, rt1);
+                if (!l.bbox.IsEmpty() && !r.bbox.IsEmpty()) {
+                    --budget;
                 }
+            }
+        }
+        out[id].axis = d;
+        if (left.empty() || right.empty()) {
+            // the clipped parts collapsed onto the plane, use the object split
+            left.clear();
+            right.clear();
+            split_d = -1;
+        }
+    }
+    if (split_d == -1 && best_d != -1) {
+        float min = cbox.p_min[best_d];
+        float scale = params.n_bins / (cbox.p_max[best_d] - min);
+        for (const BVHBuildRef &ref : rs) {
+            (BinIndex(ref.centroid[best_d], min, scale) < best_i ? left : right).push_back(ref);
+        }
+        out[id].axis = best_d;
+    } else if (split_d == -1) {
+        // all centroids coincide or the depth limit is reached
+        int d = cbox.MaxExtent();
+        int ln = len / 2;
+        std::nth_element(rs.begin(), rs.begin() + ln, rs.end(),
+            [d](const BVHBuildRef &a, const BVHBuildRef &b) {
+                return a.centroid[d] < b.centroid[d];
+            });
+        left.assign(rs.begin(), rs.begin() + ln);
+        right.assign(rs.begin() + ln, rs.end());
+        out[id].axis = d;
+    }
+    rs.clear();
+    rs.shrink_to_fit();
 
-                if (flag_l && flag_r) {
-                    if (lt0 < rt0) {
-                        s.push(u->rc);
-                        s.push(u->lc);
-                    } else {
-                        s.push(u->lc);
-                        s.push(u->rc);
-                    }
-                } else if (flag_l) {
-                    s.push(u->lc);
-                } else if (flag_r) {
-                    s.push(u->rc);
+    // the remaining budget is shared by the number of references, so that
+    // the tree does not depend on the order subtrees are built in
+    int l_budget = 0, r_budget = 0;
+    if (budget > 0) {
+        l_budget = int64_t(budget) * left.size() / (left.size() + right.size());
+        r_budget = budget - l_budget;
+    }
+    gm::BBox l_bbox, r_bbox;
+    for (const BVHBuildRef &ref : left) {
+        l_bbox.Expand(ref.bbox);
+    }
+    for (const BVHBuildRef &ref : right) {
+        r_bbox.Expand(ref.bbox);
+    }
+    if (depth < task_depth && len >= parallel_build_size) {
+        // the left subtree is built by another thread into its own node and
+        // reference arrays, both are spliced back in depth-first order
+        std::vector<BVHNode> l_nodes, r_nodes;
+        std::vector<BVHBuildRef> l_refs, r_refs;
+        auto handle = std::async(std::launch::async,
+            [this, &l_nodes, &l_refs, &left, &l_bbox, l_budget, depth]() {
+                BuildSpatialRecursive(l_nodes, l_refs, left, l_bbox, l_budget,
+                    depth + 1);
+            });
+        BuildSpatialRecursive(r_nodes, r_refs, right, r_bbox, r_budget, depth + 1);
+        handle.get();
+        for (auto &node : l_nodes) {
+            if (node.IsLeaf()) node.offset += out_refs.size();
+        }
+        out_refs.insert(out_refs.end(), l_refs.begin(), l_refs.end());
+        for (auto &node : r_nodes) {
+            if (node.IsLeaf()) node.offset += out_refs.size();
+        }
+        out_refs.insert(out_refs.end(), r_refs.begin(), r_refs.end());
+        out[id].offset = Splice(out, l_nodes, r_nodes);
+    } else {
+        BuildSpatialRecursive(out, out_refs, left, l_bbox, l_budget, depth + 1);
+        out[id].offset = BuildSpatialRecursive(out, out_refs, right, r_bbox,
+            r_budget, depth + 1);
+    }
+    return id;
+}
+
+// spreads the lower 21 bits of x so that there are two zero bits between each
+static uint64_t SpreadBits(uint64_t x) {
+    x &= 0x1fffff;
+    x = (x | (x << 32)) & 0x001f00000000ffffull;
+    x = (x | (x << 16)) & 0x001f0000ff0000ffull;
+    x = (x | (x << 8)) & 0x100f00f00f00f00full;
+    x = (x | (x << 4)) & 0x10c30c30c30c30c3ull;
+    x = (x | (x << 2)) & 0x1249249249249249ull;
+    return x;
+}
+
+// stable lsd radix sort of (code, ref) pairs, 8 bits per pass, where every
+// thread counts and scatters its own contiguous chunk
+static void RadixSort(std::vector<std::pair<uint64_t, int>> &v, int n_bits,
+        int n_threads) {
+    const int n_buckets = 256;
+    int N = v.size();
+    int chunk = (N + n_threads - 1) / n_threads;
+    std::vector<std::pair<uint64_t, int>> tmp(N);
+    std::vector<int> offsets(n_threads * n_buckets);
+    for (int low = 0; low < n_bits; low += 8) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        ParallelFor(n_threads, [&](int t) {
+            int *count = &offsets[t * n_buckets];
+            for (int i = t * chunk; i < std::min(N, (t + 1) * chunk); i++) {
+                ++count[(v[i].first >> low) & (n_buckets - 1)];
+            }
+        });
+        int sum = 0;
+        for (int b = 0; b < n_buckets; b++) {
+            for (int t = 0; t < n_threads; t++) {
+                int count = offsets[t * n_buckets + b];
+                offsets[t * n_buckets + b] = sum;
+                sum += count;
+            }
+        }
+        ParallelFor(n_threads, [&](int t) {
+            int *offset = &offsets[t * n_buckets];
+            for (int i = t * chunk; i < std::min(N, (t + 1) * chunk); i++) {
+                tmp[offset[(v[i].first >> low) & (n_buckets - 1)]++] = v[i];
+            }
+        });
+        v.swap(tmp);
+    }
+}
+
+void BVHTree::BuildLinear(const gm::BBox &cbox, bool treelets) {
+    int N = refs.size();
+    // 10 bits per axis are enough for small scenes and keep the sort short
+    int bits = N > (1 << 20) ? 21 : 10;
+    int n_bits = 3 * bits;
+    float quant = float(1 << bits);
+
+    std::vector<std::pair<uint64_t, int>> keys(N);
+    int chunk = (N + n_threads - 1) / n_threads;
+    ParallelFor(n_threads, [&](int t) {
+        for (int i = t * chunk; i < std::min(N, (t + 1) * chunk); i++) {
+            uint64_t q[3];
+            for (int d = 0; d < 3; d++) {
+                float ext = cbox.p_max[d] - cbox.p_min[d];
+                float c = ext > 0 ? (refs[i].centroid[d] - cbox.p_min[d]) / ext : 0.0f;
+                q[d] = std::clamp<uint64_t>(c * quant, 0, (1 << bits) - 1);
+            }
+            keys[i] = { (SpreadBits(q[0]) << 2) | (SpreadBits(q[1]) << 1) |
+                SpreadBits(q[2]), i };
+        }
+    });
+    RadixSort(keys, n_bits, n_threads);
+
+    std::vector<BVHBuildRef> sorted(N);
+    codes.resize(N);
+    for (int i = 0; i < N; i++) {
+        sorted[i] = refs[keys[i].second];
+        codes[i] = keys[i].first;
+    }
+    refs.swap(sorted);
+
+    if (!treelets) {
+        EmitLinear(nodes, 0, N, n_bits - 1, 0);
+        return;
+    }
+
+    // primitives sharing the leading morton bits form a treelet, treelets are
+    // emitted like the lbvh while the levels above them are built with sah
+    std::vector<Treelet> tls;
+    for (int i = 0; i < N; ) {
+        int j = i;
+        uint64_t top = codes[i] >> (n_bits - treelet_bits);
+        Treelet tl;
+        tl.start = i;
+        while (j < N && (codes[j] >> (n_bits - treelet_bits)) == top) {
+            tl.bbox.Expand(refs[j].bbox);
+            ++j;
+        }
+        tl.len = j - i;
+        tls.push_back(tl);
+        i = j;
+    }
+    BuildTreelets(nodes, tls, 0, tls.size(), n_bits - treelet_bits - 1, 0);
+}
+
+int BVHTree::EmitLinear(std::vector<BVHNode> &out, int start, int len, int bit,
+        int depth) {
+    int id = out.size();
+    out.emplace_back();
+    out[id].axis = 0;
+
+    int ln = -1;
+    if (len > std::min(lbvh_leaf_size, params.max_leaf_size)) {
+        // skip the bits shared by the whole range, the first remaining bit
+        // splits it where the sorted codes flip from 0 to 1
+        uint64_t diff = codes[start] ^ codes[start + len - 1];
+        while (bit >= 0 && !(diff >> bit & 1)) {
+            --bit;
+        }
+        if (bit >= 0) {
+            uint64_t mask = uint64_t(1) << bit;
+            ln = std::partition_point(codes.begin() + start,
+                codes.begin() + start + len,
+                [mask](uint64_t code) { return !(code & mask); }) -
+                (codes.begin() + start);
+            out[id].axis = 2 - bit % 3;
+            // morton splits may be uneven, one is taken only if median splits
+            // of its larger side still end within the depth of the traversal
+            // stack, which median splits of this node always do
+            if (depth + 1 + MedianDepth(std::max(ln, len - ln)) > MAX_LEAF_DEPTH) {
+                ln = -1;
+            }
+        }
+        if (ln == -1 && len > params.max_leaf_size) {
+            ln = len / 2;
+            // the halves may still differ at bit, so their morton splits
+            // start from it again
+            ++bit;
+        }
+    }
+
+    if (ln == -1) {
+        gm::BBox bbox;
+        for (int i = start; i < start + len; i++) {
+            bbox.Expand(refs[i].bbox);
+        }
+        out[id].bbox = bbox;
+        out[id].offset = start;
+        out[id].n_prims = len;
+        return id;
+    }
+    out[id].n_prims = 0;
+
+    int rc;
+    if (depth < task_depth && len >= parallel_build_size) {
+        std::vector<BVHNode> left;
+        auto handle = std::async(std::launch::async,
+            [this, &left, start, ln, bit, depth]() {
+                EmitLinear(left, start, ln, bit - 1, depth + 1);
+            });
+        std::vector<BVHNode> right;
+        EmitLinear(right, start + ln, len - ln, bit - 1, depth + 1);
+        handle.get();
+        rc = Splice(out, left, right);
+    } else {
+        EmitLinear(out, start, ln, bit - 1, depth + 1);
+        rc = EmitLinear(out, start + ln, len - ln, bit - 1, depth + 1);
+    }
+    out[id].offset = rc;
+    out[id].bbox = Combine(out[id + 1].bbox, out[rc].bbox);
+    return id;
+}
+
+int BVHTree::BuildTreelets(std::vector<BVHNode> &out, std::vector<Treelet> &tls,
+        int start, int len, int bit, int depth) {
+    if (len == 1) {
+        return EmitLinear(out, tls[start].start, tls[start].len, bit, depth);
+    }
+
+    int id = out.size();
+    out.emplace_back();
+    out[id].n_prims = 0;
+
+    // there are at most 2^treelet_bits treelets, so an exact sweep over the
+    // sorted treelets is cheap
+    gm::BBox bbox, cbox;
+    int n_prims = 0;
+    for (int i = start; i < start + len; i++) {
+        bbox.Expand(tls[i].bbox);
+        cbox.Expand(tls[i].bbox.Centroid());
+        n_prims += tls[i].len;
+    }
+    auto by_axis = [](int d) {
+        return [d](const Treelet &a, const Treelet &b) {
+            return a.bbox.Centroid()[d] < b.bbox.Centroid()[d];
+        };
+    };
+    int best_d = cbox.MaxExtent(), best_i = len / 2;
+    if (depth < MAX_DEPTH / 2) {
+        float best_c = std::numeric_limits<float>::max();
+        std::vector<float> r_cost(len);
+        for (int d = 0; d < 3; d++) {
+            std::sort(tls.begin() + start, tls.begin() + start + len, by_axis(d));
+            gm::BBox rb;
+            int rn = 0;
+            for (int i = len - 1; i > 0; i--) {
+                rb.Expand(tls[start + i].bbox);
+                rn += tls[start + i].len;
+                r_cost[i] = rb.SurfaceArea() * rn;
+            }
+            gm::BBox lb;
+            int ln = 0;
+            for (int i = 1; i < len; i++) {
+                lb.Expand(tls[start + i - 1].bbox);
+                ln += tls[start + i - 1].len;
+                float C = lb.SurfaceArea() * ln + r_cost[i];
+                if (C < best_c) {
+                    best_d = d;
+                    best_i = i;
+                    best_c = C;
                 }
             }
         }
     }
-    return flag;
+    std::sort(tls.begin() + start, tls.begin() + start + len, by_axis(best_d));
+    // the treelets of a side need the levels of a balanced tree over them,
+    // then median levels in the largest one, a split whose sides do not fit
+    // in the depth of the traversal stack falls back to halving the
+    // treelets, which fits whenever this node does
+    auto need = [this, &tls](int first, int n) {
+        int levels = 0, max_len = 0;
+        while ((1 << levels) < n) {
+            ++levels;
+        }
+        for (int i = first; i < first + n; i++) {
+            max_len = std::max(max_len, tls[i].len);
+        }
+        return levels + MedianDepth(max_len);
+    };
+    if (depth + 1 + std::max(need(start, best_i), need(start + best_i, len - best_i)) >
+            MAX_LEAF_DEPTH) {
+        best_d = cbox.MaxExtent();
+        best_i = len / 2;
+        std::sort(tls.begin() + start, tls.begin() + start + len, by_axis(best_d));
+    }
+    out[id].axis = best_d;
+    out[id].bbox = bbox;
+
+    int rc;
+    if (depth < task_depth && n_prims >= parallel_build_size) {
+        std::vector<BVHNode> left;
+        auto handle = std::async(std::launch::async,
+            [this, &left, &tls, start, best_i, bit, depth]() {
+                BuildTreelets(left, tls, start, best_i, bit, depth + 1);
+            });
+        std::vector<BVHNode> right;
+        BuildTreelets(right, tls, start + best_i, len - best_i, bit, depth + 1);
+        handle.get();
+        rc = Splice(out, left, right);
+    } else {
+        BuildTreelets(out, tls, start, best_i, bit, depth + 1);
+        rc = BuildTreelets(out, tls, start + best_i, len - best_i, bit, depth + 1);
+    }
+    out[id].offset = rc;
+    return id;
+}
+
+void BVHTree::Refit(const std::vector<gm::BBox> &bounds) {
+    int n_nodes = nodes.size();
+    // leaves are independent of each other
+    int n_tasks = n_nodes >= parallel_build_size ? n_threads : 1;
+    ParallelFor(n_tasks, [&](int t) {
+        int begin = int64_t(n_nodes) * t / n_tasks;
+        int end = int64_t(n_nodes) * (t + 1) / n_tasks;
+        for (int id = begin; id < end; id++) {
+            BVHNode &u = nodes[id];
+            if (!u.IsLeaf()) continue;
+            u.bbox = gm::BBox();
+            for (int i = 0; i < u.n_prims; i++) {
+                u.bbox.Expand(bounds[indices[u.offset + i]]);
+            }
+        }
+    });
+    // children always come after their parent in depth-first order
+    for (int id = n_nodes - 1; id >= 0; id--) {
+        BVHNode &u = nodes[id];
+        if (!u.IsLeaf()) {
+            u.bbox = Combine(nodes[id + 1].bbox, nodes[u.offset].bbox);
+        }
+    }
+}
+
+float BVHTree::SAHCost() const {
+    if (nodes.empty()) {
+        return 0.0f;
+    }
+    float cost = 0.0f;
+    for (const BVHNode &u : nodes) {
+        float c = u.IsLeaf() ? LeafCost(u.n_prims) : traversal_cost;
+        cost += c * u.bbox.SurfaceArea();
+    }
+    float area = nodes[0].bbox.SurfaceArea();
+    return area > 0.0f ? cost / area : 0.0f;
+}
+
+BVHStats BVHTree::GetStats() const {
+    BVHStats stats;
+    stats.n_trees = 1;
+    stats.n_nodes = nodes.size();
+    stats.n_refs = indices.size();
+    stats.n_prims = n_prims;
+    stats.sah_cost = SAHCost();
+    stats.memory = nodes.capacity() * sizeof(BVHNode) +
+        indices.capacity() * sizeof(int);
+    stats.build_ms = build_ms;
+    if (nodes.empty()) {
+        return stats;
+    }
+
+    std::pair<int, int> stack[MAX_DEPTH];
+    int top = 0;
+    stack[top++] = { 0, 0 };
+    while (top > 0) {
+        auto [id, depth] = stack[--top];
+        const BVHNode &u = nodes[id];
+        if (u.IsLeaf()) {
+            ++stats.n_leaves;
+            stats.max_depth = std::max(stats.max_depth, depth);
+            if (stats.depth_hist.size() <= depth) {
+                stats.depth_hist.resize(depth + 1);
+            }
+            ++stats.depth_hist[depth];
+            if (stats.leaf_size_hist.size() <= u.n_prims) {
+                stats.leaf_size_hist.resize(u.n_prims + 1);
+            }
+            ++stats.leaf_size_hist[u.n_prims];
+        } else {
+            stack[top++] = { u.offset, depth + 1 };
+            stack[top++] = { id + 1, depth + 1 };
+        }
+    }
+    return stats;
+}
+
+gm::BBox BVHTree::GetBBox() const {
+    return nodes.empty() ? gm::BBox() : nodes[0].bbox;
+}
+
+const std::vector<int> &BVHTree::GetIndices() const {
+    return indices;
+}
+
+const std::vector<BVHNode> &BVHTree::GetNodes() const {
+    return nodes;
 }
 
 void BVHTree::Print() const {
-    std::stack<std::pair<std::shared_ptr<BVHNode>, int>> s;
-    s.emplace(root, 0);
+    if (nodes.empty()) {
+        return;
+    }
+    std::stack<std::pair<int, int>> s;
+    s.emplace(0, 0);
     while (!s.empty()) {
-        const auto &[u, dep] = s.top();
+        auto [id, dep] = s.top();
         s.pop();
+        const BVHNode &u = nodes[id];
         std::string indent(dep, '-');
-        std::cout << indent << "(" << u->start << ", " << u->len << ")" << std::endl;
-        std::cout << indent << "bbox: (" << u->bbox.p_min << ", " << u->bbox.p_max << ")" << std::endl;
-        std::cout << indent << "lc ?= " << !!u->lc << ", rc ?= " << !!u->rc << std::endl;
-        if (u->rc) {
-            s.emplace(u->rc, dep + 1);
+        if (u.IsLeaf()) {
+            std::cout << indent << "leaf (" << u.offset << ", " << u.n_prims << ")" << std::endl;
+        } else {
+            std::cout << indent << "node " << id << ", axis = " << int(u.axis) << std::endl;
         }
-        if (u->lc) {
-            s.emplace(u->lc, dep + 1);
+        std::cout << indent << "bbox: (" << u.bbox.p_min << ", " << u.bbox.p_max << ")" << std::endl;
+        if (!u.IsLeaf()) {
+            s.emplace(u.offset, dep + 1);
+            s.emplace(id + 1, dep + 1);
         }
     }
-    for (int i = 0; i < prims.size(); i++) {
-        std::cout << "i = " << i << ", bbox = (" << prims[i]->GetBBox().p_min <<
-            ", " << prims[i]->GetBBox().p_max << std::endl;
+    for (int i = 0; i < indices.size(); i++) {
+        std::cout << "i = " << i << ", prim = " << indices[i] << std::endl;
     }
 }
 
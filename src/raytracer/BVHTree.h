@@ -1,38 +1,264 @@
 #pragma once
 
-#include <memory>
+#include <cstdint>
 #include <vector>
 
-#include "Primitive.h"
+#include "geomath.h"
+#include "BVHStats.h"
 
 namespace pepcy::renderer {
 
-class BVHNode {
-  public:
-    BVHNode(const gm::BBox &bbox, int start, int len);
+enum class BVHBuildMethod {
+    SAH,   // binned sah, best trees
+    LBVH,  // morton order, fastest builds
+    HLBVH, // morton treelets with sah over the top levels
+    SBVH   // sah with spatial splits, needs triangles, see BuildSpatial
+};
 
-    bool IsLeaf() const;
+// 32-byte node of a linearized bvh, stored in depth-first order
+// the first child of an interior node is always the next node in the array
+struct BVHNode {
+    bool IsLeaf() const {
+        return n_prims > 0;
+    }
 
-  private:
-    std::shared_ptr<BVHNode> lc, rc;
     gm::BBox bbox;
-    int start, len;
+    int offset; // leaf: first primitive, interior: index of the second child
+    unsigned short n_prims; // 0 for interior nodes
+    unsigned char axis;
+    unsigned char pad;
+};
 
-    friend class BVHTree;
+// tunable parameters of the top-down builders
+struct BVHBuildParams {
+    int max_leaf_size = 32; // at most 32 for compressed BVH4 nodes
+    int n_bins = 16; // sah bins per axis, up to BVHTree::MAX_BINS
+    // sbvh: references straddling a spatial split are clipped and duplicated,
+    // until the number of references reaches (1 + max_duplication) times the
+    // number of triangles
+    float max_duplication = 0.5f;
+    // primitives tested at once by the leaves, the sah counts whole blocks
+    int prim_block = 1;
+};
+
+// cached bounds of a primitive, only alive during a build
+struct BVHBuildRef {
+    gm::BBox bbox;
+    gm::Vector3 centroid;
+    int index;
 };
 
+// per-ray data of a traversal, set up once so that box tests need neither
+// divisions nor branches on the direction
+struct BVHRay {
+    BVHRay(const gm::Ray &r);
+
+    // slab test of [t_min, t_max] against a box, t is the entry distance
+    bool Intersect(const gm::BBox &bbox, float t_min, float t_max, float &t) const;
+
+    float orig[3];
+    float inv_dir[3];
+    int sign[3];
+};
+
+inline BVHRay::BVHRay(const gm::Ray &r) {
+    for (int d = 0; d < 3; d++) {
+        orig[d] = r.orig[d];
+        inv_dir[d] = 1.0f / r.dir[d];
+        sign[d] = inv_dir[d] < 0.0f;
+    }
+}
+
+inline bool BVHRay::Intersect(const gm::BBox &bbox, float t_min, float t_max,
+        float &t) const {
+    // a nan from 0 * inf fails both comparisons and keeps the old bound
+    for (int d = 0; d < 3; d++) {
+        float t_near = ((sign[d] ? bbox.p_max : bbox.p_min)[d] - orig[d]) * inv_dir[d];
+        float t_far = ((sign[d] ? bbox.p_min : bbox.p_max)[d] - orig[d]) * inv_dir[d];
+        t_min = t_near > t_min ? t_near : t_min;
+        t_max = t_far < t_max ? t_far : t_max;
+    }
+    t = t_min;
+    return t_min <= t_max;
+}
+
+// bvh over a set of bounds, leaves refer to primitives by their index in
+// the bounds the tree was built from
 class BVHTree {
   public:
-    void Build(const std::vector<Primitive *> &prims);
+    // SBVH falls back to SAH here, as references cannot be clipped to bounds
+    void Build(const std::vector<gm::BBox> &bounds,
+        BVHBuildMethod method = BVHBuildMethod::SAH,
+        const BVHBuildParams &params = BVHBuildParams());
+    // sbvh over triangles given as 3 points each, a primitive may appear in
+    // several leaves
+    void BuildSpatial(const std::vector<gm::Vector3> &points,
+        const BVHBuildParams &params = BVHBuildParams());
+    // recomputes node bounds bottom-up from new bounds of the same primitives,
+    // the topology of the tree is kept
+    void Refit(const std::vector<gm::BBox> &bounds);
 
-    bool Intersect(const gm::Ray &r) const;
-    bool Intersect(const gm::Ray &r, Intersection &inter) const;
+    // sah cost of the tree, relative to the surface area of its root
+    float SAHCost() const;
+    // shape of the tree and the time of its last build
+    BVHStats GetStats() const;
+
+    // func(prim) tests one primitive against r and returns whether it is hit
+    // closest hit: func has to shrink r.t_max on every hit, nodes are visited
+    // front to back and skipped once they start beyond r.t_max
+    template <typename Func>
+    bool Intersect(const gm::Ray &r, Func &&func) const;
+    // occlusion, for shadow rays: stops at the first primitive func reports
+    template <typename Func>
+    bool Occluded(const gm::Ray &r, Func &&func) const;
+
+    gm::BBox GetBBox() const;
+    const std::vector<int> &GetIndices() const;
+    const std::vector<BVHNode> &GetNodes() const;
 
     void Print() const;
 
+    static const int MAX_DEPTH = 64;
+    // deepest leaf the builders make, traversal stacks hold one entry more
+    // than the depth of the node popped
+    static const int MAX_LEAF_DEPTH = MAX_DEPTH - 2;
+    static const int MAX_BINS = 32;
+
   private:
-    std::vector<Primitive *> prims;
-    std::shared_ptr<BVHNode> root;
+    struct Bins;
+    struct SpatialBins;
+    struct Treelet {
+        int start, len;
+        gm::BBox bbox;
+    };
+
+    void SetParams(const BVHBuildParams &params);
+    // sah cost of testing the n primitives of a leaf
+    float LeafCost(int n) const;
+    // levels of median splits until len primitives fit in leaves
+    int MedianDepth(int len) const;
+    int BinIndex(float c, float min, float scale) const;
+    int BuildRecursive(std::vector<BVHNode> &out, int start, int len,
+        const gm::BBox &bbox, const gm::BBox &cbox, int depth);
+    void ComputeBins(const BVHBuildRef *rs, int len, const gm::BBox &cbox,
+        Bins &bins) const;
+    void SweepBins(const Bins &bins, const gm::BBox &bbox,
+        const gm::BBox &cbox, int &best_d, int &best_i, float &best_c) const;
+    int BuildSpatialRecursive(std::vector<BVHNode> &out,
+        std::vector<BVHBuildRef> &out_refs, std::vector<BVHBuildRef> &rs,
+        const gm::BBox &bbox, int budget, int depth);
+    // planes that more than budget references straddle are not taken
+    void SweepSpatialBins(const std::vector<BVHBuildRef> &rs,
+        const gm::BBox &bbox, int budget, int &best_d, int &best_i, float &best_c) const;
+    gm::BBox ClipRef(const BVHBuildRef &ref, int d, float lo, float hi) const;
+    void FinishBuild();
+    void BuildLinear(const gm::BBox &cbox, bool treelets);
+    int EmitLinear(std::vector<BVHNode> &out, int start, int len, int bit,
+        int depth);
+    int BuildTreelets(std::vector<BVHNode> &out, std::vector<Treelet> &tls,
+        int start, int len, int bit, int depth);
+
+    std::vector<int> indices;
+    std::vector<BVHNode> nodes;
+    std::vector<BVHBuildRef> refs;
+    std::vector<uint64_t> codes;
+    const std::vector<gm::Vector3> *points = nullptr;
+    float root_area = 0.0f;
+    BVHBuildParams params;
+    int n_prims = 0;
+    double build_ms = 0.0;
+
+    int n_threads = 1;
+    int task_depth = 0;
 };
 
+template <typename Func>
+bool BVHTree::Intersect(const gm::Ray &r, Func &&func) const {
+    BVHRay ray(r);
+    float t_root;
+    if (nodes.empty() || !ray.Intersect(nodes[0].bbox, r.t_min, r.t_max, t_root)) {
+        return false;
+    }
+
+    // only nodes hit by the ray are pushed, with their entry distances
+    struct Entry {
+        int id;
+        float t;
+    };
+    bool flag = false;
+    Entry stack[MAX_DEPTH];
+    int top = 0;
+    stack[top++] = { 0, t_root };
+    BVHCounterScope counters;
+    while (top > 0) {
+        Entry e = stack[--top];
+        if (e.t > r.t_max) continue;
+
+        const BVHNode &u = nodes[e.id];
+        ++counters.nodes;
+        if (u.IsLeaf()) {
+            for (int i = 0; i < u.n_prims; i++) {
+                if (func(indices[u.offset + i])) {
+                    flag = true;
+                }
+            }
+            continue;
+        }
+
+        counters.boxes += 2;
+        Entry c0 = { e.id + 1, 0.0f }, c1 = { u.offset, 0.0f };
+        bool hit0 = ray.Intersect(nodes[c0.id].bbox, r.t_min, r.t_max, c0.t);
+        bool hit1 = ray.Intersect(nodes[c1.id].bbox, r.t_min, r.t_max, c1.t);
+        if (hit0 && hit1) {
+            // the nearer child is popped first
+            if (c1.t < c0.t) {
+                std::swap(c0, c1);
+            }
+            stack[top++] = c1;
+            stack[top++] = c0;
+        } else if (hit0) {
+            stack[top++] = c0;
+        } else if (hit1) {
+            stack[top++] = c1;
+        }
+    }
+    return flag;
+}
+
+template <typename Func>
+bool BVHTree::Occluded(const gm::Ray &r, Func &&func) const {
+    BVHRay ray(r);
+    float t;
+    if (nodes.empty() || !ray.Intersect(nodes[0].bbox, r.t_min, r.t_max, t)) {
+        return false;
+    }
+
+    int stack[MAX_DEPTH];
+    int top = 0;
+    stack[top++] = 0;
+    BVHCounterScope counters;
+    while (top > 0) {
+        int id = stack[--top];
+        const BVHNode &u = nodes[id];
+        ++counters.nodes;
+        if (u.IsLeaf()) {
+            for (int i = 0; i < u.n_prims; i++) {
+                if (func(indices[u.offset + i])) {
+                    return true;
+                }
+            }
+            continue;
+        }
+
+        counters.boxes += 2;
+        if (ray.Intersect(nodes[u.offset].bbox, r.t_min, r.t_max, t)) {
+            stack[top++] = u.offset;
+        }
+        if (ray.Intersect(nodes[id + 1].bbox, r.t_min, r.t_max, t)) {
+            stack[top++] = id + 1;
+        }
+    }
+    return false;
+}
+
 }
\ No newline at end of file
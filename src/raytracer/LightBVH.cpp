@@ -0,0 +1,107 @@
+#include "LightBVH.h"
+
+#include <algorithm>
+
+namespace pepcy::renderer {
+
+void LightBVH::Build(const std::vector<PointLight> &point_lights,
+        const std::vector<SpotLight> &spot_lights) {
+    // spot lights are taken as point lights, their cones only make the
+    // importance an overestimate
+    std::vector<LightRef> refs;
+    for (const auto &light : point_lights) {
+        refs.push_back({ light.pos, light.color.Luminance(), int(refs.size()) });
+    }
+    for (const auto &light : spot_lights) {
+        refs.push_back({ light.pos, light.color.Luminance(), int(refs.size()) });
+    }
+    nodes.clear();
+    if (!refs.empty()) {
+        nodes.reserve(2 * refs.size() - 1);
+        BuildRecursive(refs, 0, refs.size());
+    }
+}
+
+int LightBVH::BuildRecursive(std::vector<LightRef> &refs, int begin, int end) {
+    int id = nodes.size();
+    nodes.emplace_back();
+    gm::BBox bbox;
+    float power = 0.0f;
+    for (int i = begin; i < end; i++) {
+        bbox.Expand(refs[i].pos);
+        power += refs[i].power;
+    }
+    nodes[id].bbox = bbox;
+    nodes[id].power = power;
+    if (end - begin == 1) {
+        nodes[id].leaf = true;
+        nodes[id].offset = refs[begin].index;
+        return id;
+    }
+
+    // median split along the longest axis
+    int axis = bbox.MaxExtent();
+    int mid = (begin + end) / 2;
+    std::nth_element(refs.begin() + begin, refs.begin() + mid, refs.begin() + end,
+        [axis](const LightRef &a, const LightRef &b) { return a.pos[axis] < b.pos[axis]; });
+    BuildRecursive(refs, begin, mid);
+    int second = BuildRecursive(refs, mid, end);
+    nodes[id].leaf = false;
+    nodes[id].offset = second;
+    return id;
+}
+
+float LightBVH::Importance(const Node &node, const gm::Vector3 &p,
+        const gm::Vector3 &n) const {
+    // the bounding sphere of the box, seen from p
+    gm::Vector3 center = node.bbox.Centroid();
+    float r2 = (node.bbox.p_max - center).Norm2();
+    gm::Vector3 d = center - p;
+    float d2 = d.Norm2();
+    float cos_bound = 1.0f;
+    if (d2 > r2) {
+        float cos = gm::Dot(n, d) / std::sqrt(d2);
+        float sin = std::sqrt(std::max(1.0f - cos * cos, 0.0f));
+        float sin_cone = std::sqrt(r2 / d2);
+        float cos_cone = std::sqrt(1.0f - sin_cone * sin_cone);
+        // the angle to the center less the half angle of the sphere
+        if (cos < cos_cone) {
+            cos_bound = std::max(cos * cos_cone + sin * sin_cone, 0.0f);
+        }
+    }
+    return node.power * cos_bound / std::max(d2, std::max(r2, 1e-4f));
+}
+
+bool LightBVH::Sample(const gm::Vector3 &p, const gm::Vector3 &n, float u, int &light,
+        float &pmf) const {
+    if (nodes.empty()) {
+        return false;
+    }
+    u = std::min(u, 0x1.fffffep-1f);
+    pmf = 1.0f;
+    int id = 0;
+    while (!nodes[id].leaf) {
+        int first = id + 1;
+        int second = nodes[id].offset;
+        float i0 = Importance(nodes[first], p, n);
+        float i1 = Importance(nodes[second], p, n);
+        if (i0 + i1 <= 0.0f) {
+            return false;
+        }
+        // u is rescaled into the chosen interval, so one number picks the path
+        float p0 = i0 / (i0 + i1);
+        if (u < p0) {
+            u = std::min(u / p0, 0x1.fffffep-1f);
+            pmf *= p0;
+            id = first;
+        } else {
+            u = std::min((u - p0) / (1.0f - p0), 0x1.fffffep-1f);
+            pmf *= 1.0f - p0;
+            id = second;
+        }
+    }
+    light = nodes[id].offset;
+    return Importance(nodes[id], p, n) > 0.0f;
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+
+#include "Light.h"
+
+namespace pepcy::renderer {
+
+// bvh over the point and the spot lights of a scene, to pick one light for a
+// shading point with a probability roughly following what it adds there
+// lights are numbered with the point lights first, then the spot lights
+class LightBVH {
+  public:
+    void Build(const std::vector<PointLight> &point_lights,
+        const std::vector<SpotLight> &spot_lights);
+
+    // walks down from the root, taking each child with a probability
+    // proportional to its importance for p with normal n, u in [0, 1) picks
+    // the light and pmf is the probability it was picked with, false if no
+    // light is above the tangent plane of p
+    bool Sample(const gm::Vector3 &p, const gm::Vector3 &n, float u, int &light,
+        float &pmf) const;
+
+  private:
+    struct Node {
+        gm::BBox bbox;
+        float power;
+        // leaf: the light, interior: index of the second child, the first one
+        // is the next node
+        int offset;
+        bool leaf;
+    };
+
+    struct LightRef {
+        gm::Vector3 pos;
+        float power;
+        int index;
+    };
+
+    int BuildRecursive(std::vector<LightRef> &refs, int begin, int end);
+    // power over the squared distance to the node, times a bound of the
+    // cosine between n and the directions to it, 0 if it is all below p
+    float Importance(const Node &node, const gm::Vector3 &p, const gm::Vector3 &n) const;
+
+    std::vector<Node> nodes;
+};
+
+}
\ No newline at end of file
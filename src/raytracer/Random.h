@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+
+namespace pepcy::renderer {
+
+// pcg32 random numbers, seeded from the pixel, the sample and the frame seed
+// a sample draws the same numbers whichever thread traces it and in whatever
+// order, so renders are reproducible
+class Rng {
+  public:
+    Rng(uint32_t pixel, uint32_t sample, uint32_t seed) {
+        uint64_t key = (uint64_t(pixel) << 32 | sample) ^ (uint64_t(seed) * 0x9e3779b97f4a7c15ull);
+        state = 0;
+        inc = Mix(key ^ 0xda942042e4dd58b5ull) << 1 | 1;
+        NextUint();
+        state += Mix(key);
+        NextUint();
+    }
+
+    uint32_t NextUint() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ull + inc;
+        uint32_t xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+        uint32_t rot = uint32_t(old >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+    }
+
+    // uniform in [0, 1)
+    float NextFloat() {
+        return (NextUint() >> 8) * (1.0f / 16777216.0f);
+    }
+
+  private:
+    // splitmix64 finalizer, neighbouring keys give unrelated states
+    static uint64_t Mix(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    uint64_t state;
+    uint64_t inc;
+};
+
+}
\ No newline at end of file
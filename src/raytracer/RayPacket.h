@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+
+#include "BVH4.h"
+
+namespace pepcy::renderer {
+
+// N rays traced through a bvh together, lanes are selected by bit masks
+// box tests run on the rays in SoA layout, 4 lanes at a time
+template <int N>
+struct RayPacket {
+    static_assert(N % 4 == 0 && N <= 32, "packets hold 4 to 32 rays");
+
+    // copies the active rays into the SoA layout, and finds whether they
+    // share the signs of their directions, which allows interval culling
+    void Setup(uint32_t mask);
+
+    // false only if no active ray can hit the box, for coherent packets
+    bool MayHit(const float *lo, const float *hi) const;
+    // mask of the lanes in mask that hit the box, and their nearest entry
+    uint32_t Intersect(const float *lo, const float *hi, uint32_t mask,
+        float &t) const;
+    float MaxT(uint32_t mask) const;
+
+    gm::Ray rays[N];
+
+    alignas(16) float orig[3][N];
+    alignas(16) float inv_dir[3][N];
+    alignas(16) float t_min[N];
+    alignas(16) float t_max[N];
+
+    bool coherent;
+    int sign[3];
+    // bounds of the origins and inverse directions of the active rays
+    float orig_lo[3], orig_hi[3];
+    float inv_lo[3], inv_hi[3];
+    float t_min_lo, t_max_hi;
+};
+
+template <int N>
+void RayPacket<N>::Setup(uint32_t mask) {
+    coherent = true;
+    t_min_lo = std::numeric_limits<float>::max();
+    t_max_hi = -std::numeric_limits<float>::max();
+    for (int d = 0; d < 3; d++) {
+        sign[d] = -1;
+        orig_lo[d] = inv_lo[d] = std::numeric_limits<float>::max();
+        orig_hi[d] = inv_hi[d] = -std::numeric_limits<float>::max();
+    }
+    for (int k = 0; k < N; k++) {
+        t_min[k] = rays[k].t_min;
+        t_max[k] = rays[k].t_max;
+        for (int d = 0; d < 3; d++) {
+            orig[d][k] = rays[k].orig[d];
+            inv_dir[d][k] = 1.0f / rays[k].dir[d];
+        }
+        if (!(mask >> k & 1)) continue;
+
+        t_min_lo = std::min(t_min_lo, t_min[k]);
+        t_max_hi = std::max(t_max_hi, t_max[k]);
+        for (int d = 0; d < 3; d++) {
+            int s = inv_dir[d][k] < 0.0f;
+            if (sign[d] == -1) {
+                sign[d] = s;
+            } else if (sign[d] != s) {
+                coherent = false;
+            }
+            orig_lo[d] = std::min(orig_lo[d], orig[d][k]);
+            orig_hi[d] = std::max(orig_hi[d], orig[d][k]);
+            inv_lo[d] = std::min(inv_lo[d], inv_dir[d][k]);
+            inv_hi[d] = std::max(inv_hi[d], inv_dir[d][k]);
+        }
+    }
+}
+
+template <int N>
+bool RayPacket<N>::MayHit(const float *lo, const float *hi) const {
+    // every ray enters after the smallest near distance on each axis, and
+    // leaves before the largest far distance, the bounds come from interval
+    // products of plane offsets and inverse directions of the same sign
+    float t0 = t_min_lo, t1 = t_max_hi;
+    for (int d = 0; d < 3; d++) {
+        if (std::isinf(inv_lo[d]) || std::isinf(inv_hi[d])) continue;
+
+        float p_near = sign[d] ? hi[d] : lo[d];
+        float p_far = sign[d] ? lo[d] : hi[d];
+        float n0 = (p_near - orig_hi[d]) * inv_lo[d];
+        float n1 = (p_near - orig_hi[d]) * inv_hi[d];
+        float n2 = (p_near - orig_lo[d]) * inv_lo[d];
+        float n3 = (p_near - orig_lo[d]) * inv_hi[d];
+        float f0 = (p_far - orig_hi[d]) * inv_lo[d];
+        float f1 = (p_far - orig_hi[d]) * inv_hi[d];
+        float f2 = (p_far - orig_lo[d]) * inv_lo[d];
+        float f3 = (p_far - orig_lo[d]) * inv_hi[d];
+        t0 = std::max(t0, std::min(std::min(n0, n1), std::min(n2, n3)));
+        t1 = std::min(t1, std::max(std::max(f0, f1), std::max(f2, f3)));
+    }
+    return t0 <= t1;
+}
+
+template <int N>
+uint32_t RayPacket<N>::Intersect(const float *lo, const float *hi,
+        uint32_t mask, float &t) const {
+    // lanes can differ in direction signs, so both planes are sorted per lane
+    uint32_t hit = 0;
+    t = std::numeric_limits<float>::max();
+    for (int k = 0; k < N; k += 4) {
+        uint32_t lanes = mask >> k & 0xf;
+        if (lanes == 0) continue;
+
+        alignas(16) float t_enter[4];
+        uint32_t m = 0;
+#ifdef PEPCY_BVH4_SSE
+        __m128 t0 = _mm_load_ps(t_min + k);
+        __m128 t1 = _mm_load_ps(t_max + k);
+        for (int d = 0; d < 3; d++) {
+            __m128 o = _mm_load_ps(orig[d] + k);
+            __m128 inv = _mm_load_ps(inv_dir[d] + k);
+            __m128 a = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(lo[d]), o), inv);
+            __m128 b = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(hi[d]), o), inv);
+            t0 = _mm_max_ps(_mm_min_ps(a, b), t0);
+            t1 = _mm_min_ps(_mm_max_ps(a, b), t1);
+        }
+        _mm_store_ps(t_enter, t0);
+        m = _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & lanes;
+#else
+        for (int i = 0; i < 4; i++) {
+            float t0 = t_min[k + i], t1 = t_max[k + i];
+            for (int d = 0; d < 3; d++) {
+                float a = (lo[d] - orig[d][k + i]) * inv_dir[d][k + i];
+                float b = (hi[d] - orig[d][k + i]) * inv_dir[d][k + i];
+                float tn = a < b ? a : b, tf = a < b ? b : a;
+                t0 = tn > t0 ? tn : t0;
+                t1 = tf < t1 ? tf : t1;
+            }
+            t_enter[i] = t0;
+            if (t0 <= t1) {
+                m |= 1 << i;
+            }
+        }
+        m &= lanes;
+#endif
+        for (int i = 0; i < 4; i++) {
+            if (m >> i & 1) {
+                t = std::min(t, t_enter[i]);
+            }
+        }
+        hit |= m << k;
+    }
+    return hit;
+}
+
+template <int N>
+float RayPacket<N>::MaxT(uint32_t mask) const {
+    float ret = -std::numeric_limits<float>::max();
+    for (int k = 0; k < N; k++) {
+        if (mask >> k & 1) {
+            ret = std::max(ret, t_max[k]);
+        }
+    }
+    return ret;
+}
+
+}
\ No newline at end of file
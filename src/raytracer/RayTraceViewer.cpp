@@ -1,102 +1,453 @@
 #include "RayTraceViewer.h"
 
-#include <future>
-#include <random>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <limits>
 
 #include "stb_image_write.h"
 #include "../defines.h"
 #include "BasicShape.h"
-#include "Triangle.h"
-
-static std::random_device rnd_dv;
-static std::mt19937 rnd_gen(rnd_dv());
-static std::uniform_real_distribution rnd_real(0.0f, 1.0f);
+#include "RayPacket.h"
+#include "TileScheduler.h"
 
 namespace pepcy::renderer {
 
 RayTraceViewer raytrace_viewer;
 
-RayTraceViewer::RayTraceViewer() {
-    img = nullptr;
+RayTraceViewer::RayTraceViewer() {}
+
+RayTraceViewer::~RayTraceViewer() {
+    StopProgressive();
+}
+
+void RayTraceViewer::SetConfig(const RayTraceViewerConfig &config) {
+    this->config = config;
+}
+
+void RayTraceViewer::Resize(int width, int height) {
+    config.width = width;
+    config.height = height;
+}
+
+static gm::Color Albedo(const Material &mat) {
+    auto albedo = mat.GetTexture("albedo");
+    if (albedo.IsColor()) {
+        return albedo.GetColor() * gm::PI_INV;
+    } else { // TODO - sample texture
+        return gm::Color(1.0f, 1.0f, 1.0f) * gm::PI_INV;
+    }
+}
+
+static bool SameColor(const gm::Color &a, const gm::Color &b) {
+    return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+static bool SameLight(const DirectionalLight &a, const DirectionalLight &b) {
+    return SameColor(a.color, b.color) && a.dir == b.dir;
+}
+
+static bool SameLight(const PointLight &a, const PointLight &b) {
+    return SameColor(a.color, b.color) && a.pos == b.pos &&
+        a.kc == b.kc && a.kl == b.kl && a.kq == b.kq;
+}
 
-    for (int i = 0; i < N_SAMPLES; i++) {
-        samples[i][0] = float(i) / N_SAMPLES;
-        float t = 0.5f, res = 0.0f;
-        int j = i;
-        while (j) {
-            res += t * (j & 1);
-            t /= 2.0f;
-            j >>= 1;
+static bool SameLight(const SpotLight &a, const SpotLight &b) {
+    return SameColor(a.color, b.color) && a.pos == b.pos && a.dir == b.dir &&
+        a.kc == b.kc && a.kl == b.kl && a.kq == b.kq &&
+        a.cutoff == b.cutoff && a.outer_cutoff == b.outer_cutoff;
+}
+
+template <typename L>
+static bool SameLights(const std::vector<L> &a, const std::vector<L> &b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (int i = 0; i < a.size(); i++) {
+        if (!SameLight(a[i], b[i])) {
+            return false;
         }
-        samples[i][1] = res;
     }
+    return true;
 }
 
-RayTraceViewer::~RayTraceViewer() {
-    delete[] img;
+void RayTraceViewer::BeginTrace() {
+    trace.width = config.width;
+    trace.height = config.height;
+    trace.seed = config.seed;
+    trace.sampler = config.sampler;
+    trace.accel = config.accel;
+    trace.cam = *config.cam;
+    trace.dir_lights = config.scene->GetDirLights();
+    trace.point_lights = config.scene->GetPointLights();
+    trace.spot_lights = config.scene->GetSpotLights();
+    trace.adaptive = config.adaptive;
+    trace.adaptive_threshold = config.adaptive_threshold;
+    trace.wavefront = config.wavefront;
+    trace.wavefront_sort = config.wavefront_sort;
+    trace.sample_lights = config.sample_lights;
+    trace.light_samples = std::max(config.light_samples, 1);
+    light_bvh.Build(trace.point_lights, trace.spot_lights);
+    trace.albedo.resize(scene_bvh.GetInstanceCount());
+    for (int i = 0; i < trace.albedo.size(); i++) {
+        trace.albedo[i] = Albedo(scene_bvh.GetInstance(i).sh->GetMaterial());
+    }
+    int n_pixels = trace.width * trace.height;
+    accum.assign(n_pixels, gm::Color());
+    accum_sq.assign(n_pixels, 0.0f);
+    spp.assign(n_pixels, 0);
+    converged.assign(n_pixels, 0);
+    std::lock_guard<std::mutex> lock(preview_mutex);
+    img.assign(n_pixels * 3, 0);
+    img_spp.assign(n_pixels, 0);
 }
 
-void RayTraceViewer::SetConfig(const RayTraceViewerConfig &config) {
-    bool resize = config.width != this->config.width ||
-        config.height != this->config.height;
-    this->config = config;
-    if (resize) {
-        Resize(config.width, config.height);
+void RayTraceViewer::Resolve() {
+    for (int i = 0; i < trace.height; i++) {
+        for (int j = 0; j < trace.width; j++) {
+            int ind = i * trace.width + j;
+            SetColor(i, j, spp[ind] > 0 ? accum[ind] / spp[ind] : gm::Color());
+        }
     }
+    img_spp = spp;
 }
 
-void RayTraceViewer::Resize(int width, int height) {
-    delete[] img;
-    img = new unsigned char[width * height * 3];
+int RayTraceViewer::UpdateConvergence() {
+    std::vector<char> noisy(spp.size());
+    for (int ind = 0; ind < spp.size(); ind++) {
+        int n = spp[ind];
+        if (n < MIN_ADAPTIVE_SPP) {
+            noisy[ind] = 1;
+            continue;
+        }
+        // the 95% confidence interval of the mean luminance, relative to the
+        // mean, with a floor so that dark pixels need not be exact
+        float mean = accum[ind].Luminance() / n;
+        float var = std::max(accum_sq[ind] / n - mean * mean, 0.0f) * n / (n - 1);
+        float err = 1.96f * std::sqrt(var / n);
+        noisy[ind] = err > trace.adaptive_threshold * (mean + 0.01f);
+    }
+    // a few samples that all missed a thin feature look converged, so a pixel
+    // is sampled on while any of its neighbours is noisy
+    int n_active = 0;
+    for (int i = 0; i < trace.height; i++) {
+        for (int j = 0; j < trace.width; j++) {
+            int ind = i * trace.width + j;
+            bool active = false;
+            for (int di = -1; di <= 1 && !active; di++) {
+                for (int dj = -1; dj <= 1 && !active; dj++) {
+                    int ni = i + di, nj = j + dj;
+                    active = ni >= 0 && ni < trace.height && nj >= 0 && nj < trace.width &&
+                        noisy[ni * trace.width + nj];
+                }
+            }
+            converged[ind] = !active || spp[ind] >= MAX_ADAPTIVE_SPP;
+            n_active += !converged[ind];
+        }
+    }
+    return n_active;
 }
 
 void RayTraceViewer::Draw() {
-    ++n_shot;
-    std::string name = "ray_trace_" + std::to_string(n_shot);
-
-    std::cout << "build BVH" << std::endl;
+    StopProgressive();
     BuildBVH();
-    // bvh_tree.Print();
+    BeginTrace();
 
     std::cout << "begin tracing" << std::endl;
-    std::vector<std::future<void>> handles;
-    for (int i = 0; i < config.height; i += 32) {
-        for (int j = 0; j < config.width; j += 32) {
-            int h = std::min(32, config.height - i);
-            int w = std::min(32, config.width - j);
-            handles.push_back(std::async(std::launch::async,
-                [this, i, j, h, w]() { DrawQuad(i, j, h, w); }));
+    ResetBVHCounters();
+    EnableBVHCounters(config.count_traversal);
+    auto start = std::chrono::steady_clock::now();
+    auto on_progress = [](float progress) {
+        std::cout << "traced " << int(progress * 100.0f) << "%" << std::endl;
+    };
+    bool finished;
+    if (!trace.adaptive) {
+        finished = TileScheduler::Get().Run(trace.height, trace.width, TILE_SIZE, MIN_TILE_SIZE,
+            [this](const Tile &tile) { DrawQuad(tile.i0, tile.j0, tile.h, tile.w, N_SAMPLES); },
+            on_progress);
+    } else {
+        // a few samples for every pixel, then the rest of the budget of
+        // N_SAMPLES per pixel goes in batches to the pixels not converged
+        int64_t budget = int64_t(N_SAMPLES) * trace.width * trace.height;
+        int64_t used = 0;
+        int n_samples = MIN_ADAPTIVE_SPP;
+        int n_active = trace.width * trace.height;
+        while (true) {
+            finished = TileScheduler::Get().Run(trace.height, trace.width, TILE_SIZE,
+                MIN_TILE_SIZE,
+                [this, n_samples](const Tile &tile) {
+                    DrawQuad(tile.i0, tile.j0, tile.h, tile.w, n_samples);
+                },
+                on_progress);
+            used += int64_t(n_samples) * n_active;
+            if (!finished) {
+                break;
+            }
+            n_active = UpdateConvergence();
+            if (n_active == 0) {
+                break;
+            }
+            n_samples = std::min<int64_t>(ADAPTIVE_BATCH, (budget - used) / n_active);
+            if (n_samples <= 0) {
+                break;
+            }
         }
+        std::cout << "adaptive: " << double(used) / (trace.width * trace.height) <<
+            " samples/pixel, " << n_active << " pixels not converged" << std::endl;
     }
-    for (auto &handle : handles) {
-        handle.get();
+    trace_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+    EnableBVHCounters(false);
+    counters = GetBVHCounters();
+    if (config.count_traversal && counters.rays > 0) {
+        std::cout << "traversal: " << counters.rays << " rays, " <<
+            double(counters.nodes) / counters.rays << " nodes/ray, " <<
+            double(counters.triangles) / counters.rays << " triangles/ray" << std::endl;
     }
 
-    std::string filename = shot_path + name + ".png";
-    stbi_write_png(filename.c_str(), config.width, config.height, 3, img, config.width * 3);
+    if (!finished) {
+        std::cout << "cancelled" << std::endl;
+        return;
+    }
+    Resolve();
+    SaveImage();
     std::cout << "end" << std::endl;
 }
 
-void RayTraceViewer::DrawQuad(int i0, int j0, int h, int w) {
-    for (int i = 0; i < h; i++) {
-        for (int j = 0; j < w; j++) {
-            gm::Color col;
-            for (int k = 0; k < N_SAMPLES; k++) {
-                float x = j0 + j + samples[k][0];
-                float y = i0 + i + samples[k][1];
-                gm::Ray r = config.cam->GenRay(x / config.width, y / config.height);
-                gm::Color res = Raytrace(r);
-                col += res;
+void RayTraceViewer::StartProgressive() {
+    StopProgressive();
+    BuildBVH();
+    BeginTrace();
+    n_passes = 0;
+    progressive_stop = false;
+    progressive_thread = std::thread([this]() { Progressive(); });
+}
+
+void RayTraceViewer::StopProgressive() {
+    if (!progressive_thread.joinable()) {
+        return;
+    }
+    progressive_stop = true;
+    TileScheduler::Get().Cancel();
+    progressive_thread.join();
+}
+
+bool RayTraceViewer::IsProgressive() const {
+    return progressive_thread.joinable();
+}
+
+void RayTraceViewer::Update() {
+    if (!IsProgressive()) {
+        return;
+    }
+    bool changed = config.width != trace.width || config.height != trace.height ||
+        config.seed != trace.seed || config.sampler != trace.sampler ||
+        !(config.accel == trace.accel) ||
+        config.adaptive != trace.adaptive ||
+        config.adaptive_threshold != trace.adaptive_threshold ||
+        config.wavefront != trace.wavefront || config.wavefront_sort != trace.wavefront_sort ||
+        config.sample_lights != trace.sample_lights ||
+        (config.sample_lights && config.light_samples != trace.light_samples) ||
+        config.cam->GetMatrix() != trace.cam->GetMatrix() ||
+        !SameLights(config.scene->GetDirLights(), trace.dir_lights) ||
+        !SameLights(config.scene->GetPointLights(), trace.point_lights) ||
+        !SameLights(config.scene->GetSpotLights(), trace.spot_lights) ||
+        !scene_bvh.IsUpToDate(config.scene->GetMeshes());
+    // the bvh is up to date, so its instances are the meshes traced
+    for (int i = 0; !changed && i < trace.albedo.size(); i++) {
+        changed = !SameColor(Albedo(scene_bvh.GetInstance(i).sh->GetMaterial()), trace.albedo[i]);
+    }
+    if (changed) {
+        StartProgressive();
+    }
+}
+
+void RayTraceViewer::Progressive() {
+    for (int pass = 0; pass < MAX_PASSES && !progressive_stop; pass++) {
+        // tiles still queued when stopped are skipped, a cancel may come
+        // between two passes and be missed by the scheduler
+        TileScheduler::Get().Run(trace.height, trace.width, TILE_SIZE, MIN_TILE_SIZE,
+            [this](const Tile &tile) {
+                if (!progressive_stop) {
+                    DrawQuad(tile.i0, tile.j0, tile.h, tile.w, 1);
+                }
+            });
+        if (progressive_stop) {
+            break;
+        }
+        // converged pixels are skipped by the later passes
+        bool done = trace.adaptive && UpdateConvergence() == 0;
+        {
+            std::lock_guard<std::mutex> lock(preview_mutex);
+            Resolve();
+            n_passes = pass + 1;
+            ++preview_version;
+        }
+        if (done) {
+            break;
+        }
+    }
+}
+
+int RayTraceViewer::GetPassCount() const {
+    return n_passes;
+}
+
+bool RayTraceViewer::GetPreview(uint64_t &version, std::vector<unsigned char> &pixels,
+        int &width, int &height) const {
+    std::lock_guard<std::mutex> lock(preview_mutex);
+    if (version == preview_version) {
+        return false;
+    }
+    version = preview_version;
+    pixels = img;
+    width = trace.width;
+    height = trace.height;
+    return true;
+}
+
+void RayTraceViewer::SaveImage() {
+    ++n_shot;
+    std::string filename = shot_path + "ray_trace_" + std::to_string(n_shot) + ".png";
+    std::lock_guard<std::mutex> lock(preview_mutex);
+    if (img.empty()) {
+        return;
+    }
+    stbi_write_png(filename.c_str(), trace.width, trace.height, 3, img.data(), trace.width * 3);
+    std::cout << "image saved to " << filename << std::endl;
+    if (trace.adaptive) {
+        SaveHeatmap(shot_path + "ray_trace_" + std::to_string(n_shot) + "_spp.png");
+    }
+}
+
+void RayTraceViewer::SaveHeatmap(const std::string &filename) const {
+    // blue for the fewest samples a pixel can get, through green, to red for
+    // the most
+    std::vector<unsigned char> heat(trace.width * trace.height * 3);
+    for (int i = 0; i < trace.height; i++) {
+        for (int j = 0; j < trace.width; j++) {
+            float x = float(img_spp[i * trace.width + j] - MIN_ADAPTIVE_SPP) /
+                (MAX_ADAPTIVE_SPP - MIN_ADAPTIVE_SPP);
+            x = std::clamp(x, 0.0f, 1.0f);
+            int ind = ((trace.height - i - 1) * trace.width + j) * 3;
+            heat[ind] = 255 * std::clamp(2.0f * x - 1.0f, 0.0f, 1.0f);
+            heat[ind + 1] = 255 * (1.0f - std::abs(2.0f * x - 1.0f));
+            heat[ind + 2] = 255 * std::clamp(1.0f - 2.0f * x, 0.0f, 1.0f);
+        }
+    }
+    stbi_write_png(filename.c_str(), trace.width, trace.height, 3, heat.data(), trace.width * 3);
+    std::cout << "sample heatmap saved to " << filename << std::endl;
+}
+
+void RayTraceViewer::Cancel() {
+    TileScheduler::Get().Cancel();
+}
+
+float RayTraceViewer::GetProgress() const {
+    return TileScheduler::Get().GetProgress();
+}
+
+static gm::Ray PointShadowRay(const gm::Vector3 &hit_p, const gm::Vector3 &hit_n,
+        const PointLight &light) {
+    return gm::Ray(hit_p + hit_n * 0.005f, light.pos - hit_p);
+}
+
+void RayTraceViewer::DrawQuad(int i0, int j0, int h, int w, int n_samples) {
+    if (trace.wavefront) {
+        DrawWavefront(i0, j0, h, w, n_samples);
+        return;
+    }
+    // camera rays of a block of pixels at the same sample form a packet, and
+    // so do the shadow rays from their hits to each point light, unless the
+    // lights are sampled
+    const auto &point_lights = trace.point_lights;
+    int n_point = trace.sample_lights ? 0 : point_lights.size();
+    RayPacket<PACKET_SIZE> p, sp;
+    HitRecord hits[PACKET_SIZE];
+    Intersection inters[PACKET_SIZE];
+    std::vector<char> point_vis(PACKET_SIZE * n_point);
+    for (int bi = 0; bi < h; bi += PACKET_H) {
+        for (int bj = 0; bj < w; bj += PACKET_W) {
+            // converged pixels are left out of the packet, the samples of a
+            // pixel go on from the ones it already has
+            uint32_t mask = 0;
+            int first[PACKET_SIZE];
+            for (int k = 0; k < PACKET_SIZE; k++) {
+                int i = i0 + bi + k / PACKET_W;
+                int j = j0 + bj + k % PACKET_W;
+                if (bi + k / PACKET_W < h && bj + k % PACKET_W < w &&
+                        !converged[i * trace.width + j]) {
+                    mask |= 1u << k;
+                    first[k] = spp[i * trace.width + j];
+                }
+            }
+            if (mask == 0) {
+                continue;
+            }
+
+            gm::Color cols[PACKET_SIZE];
+            float lum_sq[PACKET_SIZE] = {};
+            for (int t = 0; t < n_samples; t++) {
+                for (int k = 0; k < PACKET_SIZE; k++) {
+                    if (!(mask >> k & 1)) continue;
+                    int i = i0 + bi + k / PACKET_W;
+                    int j = j0 + bj + k % PACKET_W;
+                    Sampler sampler(trace.sampler, i * trace.width + j, first[k] + t, trace.seed);
+                    sampler.SetDimension(CAMERA_DIM);
+                    auto [dx, dy] = sampler.Get2D();
+                    p.rays[k] = trace.cam->GenRay((j + dx) / trace.width, (i + dy) / trace.height);
+                }
+                uint32_t hit = scene_bvh.Intersect(p, mask, hits);
+                for (int k = 0; k < PACKET_SIZE; k++) {
+                    if (hit >> k & 1) {
+                        scene_bvh.Interpolate(p.rays[k], hits[k], inters[k]);
+                    }
+                }
+
+                for (int l = 0; l < n_point; l++) {
+                    uint32_t s_mask = 0;
+                    for (int k = 0; k < PACKET_SIZE; k++) {
+                        if (!(hit >> k & 1)) continue;
+                        gm::Vector3 hit_p = p.rays[k].orig + p.rays[k].dir * inters[k].t;
+                        if (gm::Dot(inters[k].norm, point_lights[l].pos - hit_p) >= 0) {
+                            sp.rays[k] = PointShadowRay(hit_p, inters[k].norm, point_lights[l]);
+                            s_mask |= 1u << k;
+                        }
+                    }
+                    uint32_t occluded = scene_bvh.Occluded(sp, s_mask);
+                    for (int k = 0; k < PACKET_SIZE; k++) {
+                        point_vis[k * n_point + l] = (s_mask & ~occluded) >> k & 1;
+                    }
+                }
+
+                for (int k = 0; k < PACKET_SIZE; k++) {
+                    if (hit >> k & 1) {
+                        int i = i0 + bi + k / PACKET_W;
+                        int j = j0 + bj + k % PACKET_W;
+                        Sampler sampler(trace.sampler, i * trace.width + j, first[k] + t,
+                            trace.seed);
+                        gm::Color col = Shade(p.rays[k], inters[k], hits[k].inst, sampler, 0,
+                            n_point > 0 ? point_vis.data() + k * n_point : nullptr);
+                        cols[k] += col;
+                        lum_sq[k] += col.Luminance() * col.Luminance();
+                    }
+                }
+            }
+
+            for (int k = 0; k < PACKET_SIZE; k++) {
+                if (mask >> k & 1) {
+                    int ind = (i0 + bi + k / PACKET_W) * trace.width + j0 + bj + k % PACKET_W;
+                    accum[ind] += cols[k];
+                    accum_sq[ind] += lum_sq[k];
+                    spp[ind] += n_samples;
+                }
             }
-            col /= N_SAMPLES;
-            SetColor(i0 + i, j0 + j, col);
         }
     }
 }
 
-static gm::Vector3 Sample(float &pdf) {
-    float xi1 = rnd_real(rnd_gen);
-    float xi2 = rnd_real(rnd_gen);
+static gm::Vector3 Sample(Sampler &sampler, float &pdf) {
+    auto [xi1, xi2] = sampler.Get2D();
 
     float sin = std::sqrt(xi1);
     float cos = std::sqrt(1 - xi1);
@@ -111,117 +462,487 @@ static gm::Vector3 Sample(float &pdf) {
     return gm::Vector3(xs, ys, zs);
 }
 
-gm::Color RayTraceViewer::Raytrace(const gm::Ray &r, int depth) {
+gm::Color RayTraceViewer::Raytrace(const gm::Ray &r, Sampler &sampler, int depth) {
     if (depth >= MAX_TRACE_DEPTH) {
         return gm::Color();
     }
 
-    Intersection inter;
-    if (!bvh_tree.Intersect(r, inter)) {
+    HitRecord hit;
+    if (!scene_bvh.Intersect(r, hit)) {
         return gm::Color();
     }
+    Intersection inter;
+    scene_bvh.Interpolate(r, hit, inter);
+    return Shade(r, inter, hit.inst, sampler, depth);
+}
 
-    gm::Vector3 hit_p = r.orig + r.dir * inter.t;
-    gm::Vector3 hit_n = inter.norm;
-    gm::Vector3 hit_t = inter.tan;
-    gm::Vector3 hit_b = gm::Cross(hit_n, hit_t);
-    gm::Matrix3 o2w(hit_t, hit_b, hit_n);
-    gm::Matrix3 w2o = gm::Transpose(o2w);
-    
-    gm::Vector3 w_out = gm::Normalize(w2o * (r.orig - hit_p));
-    gm::Color f;
-    if (auto p = dynamic_cast<const Triangle *>(inter.prim)) {
-        auto albedo = p->GetMaterial().GetTexture("albedo");
-        if (albedo.IsColor()) {
-            f = albedo.GetColor() * gm::PI_INV;
-        } else { // TODO - sample texture
-            f = gm::Color(1.0f, 1.0f, 1.0f) * gm::PI_INV;
-        }
-    }
-
-    gm::Color L_out;
-    for (const auto &light : config.scene->GetDirLights()) {
+template <typename Visit>
+void RayTraceViewer::DirectLights(const gm::Vector3 &hit_p, const gm::Vector3 &hit_n,
+        const gm::Matrix3 &w2o, const gm::Color &f, Sampler &sampler, int depth,
+        Visit visit) const {
+    const auto &dir_lights = trace.dir_lights;
+    const auto &point_lights = trace.point_lights;
+    const auto &spot_lights = trace.spot_lights;
+    int n_dir = dir_lights.size();
+    int n_point = point_lights.size();
+    auto point_light = [&](int l, float weight) {
+        const auto &light = point_lights[l];
         gm::Color L_light = light.color;
-        gm::Vector3 light_dir = -light.dir;
+        gm::Vector3 light_dir = light.pos - hit_p;
         gm::Vector3 w_in = w2o * light_dir;
         if (w_in[2] < 0) {
-            continue;
+            return;
         }
         float cos = w_in[2];
-        gm::Ray shadow(hit_p + hit_n * 0.001f, light_dir);
-        if (!bvh_tree.Intersect(shadow)) {
-            L_out += f * L_light * cos;
-        }
-    }
-    for (const auto &light : config.scene->GetPointLights()) {
+        float dist = light_dir.Norm();
+        visit(PointShadowRay(hit_p, hit_n, light),
+            f * L_light * (cos * light.GetAtten(dist / 10.0f) * weight), n_dir + l);
+    };
+    auto spot_light = [&](int l, float weight) {
+        const auto &light = spot_lights[l];
         gm::Color L_light = light.color;
         gm::Vector3 light_dir = light.pos - hit_p;
         gm::Vector3 w_in = w2o * light_dir;
         if (w_in[2] < 0) {
-            continue;
+            return;
         }
         float cos = w_in[2];
-        gm::Ray shadow(hit_p + hit_n * 0.005f, light_dir);
         float dist = light_dir.Norm();
-        if (!bvh_tree.Intersect(shadow)) {
-            L_out += f * L_light * cos * light.GetAtten(dist / 10.0f);
-            // L_out += f * L_light * cos;
-        }
-    }
-    for (const auto &light : config.scene->GetSpotLights()) {
+        float theta = std::acos(gm::Dot(light_dir, light.dir));
+        float atten = light.GetAtten(dist / 10.0f, theta);
+        visit(gm::Ray(hit_p + hit_n * 0.001f, light_dir), f * L_light * (cos * atten * weight),
+            n_dir + n_point + l);
+    };
+
+    // directional lights have no position to place them in the light bvh,
+    // and are few, so they are all taken
+    for (int l = 0; l < dir_lights.size(); l++) {
+        const auto &light = dir_lights[l];
         gm::Color L_light = light.color;
-        gm::Vector3 light_dir = light.pos - hit_p;
+        gm::Vector3 light_dir = -light.dir;
         gm::Vector3 w_in = w2o * light_dir;
         if (w_in[2] < 0) {
             continue;
         }
         float cos = w_in[2];
-        gm::Ray shadow(hit_p + hit_n * 0.001f, light_dir);
-        float dist = light_dir.Norm();
-        float theta = std::acos(gm::Dot(light_dir, light.dir));
-        float atten = light.GetAtten(dist / 10.0f, theta);
-        if (!bvh_tree.Intersect(shadow)) {
-            L_out += f * L_light * cos * atten;
-            // L_out += f * L_light * cos;
+        visit(gm::Ray(hit_p + hit_n * 0.001f, light_dir), f * L_light * cos, l);
+    }
+    // with no more lights than samples, taking them all is both cheaper and
+    // exact
+    if (!trace.sample_lights || n_point + spot_lights.size() <= trace.light_samples) {
+        for (int l = 0; l < point_lights.size(); l++) {
+            point_light(l, 1.0f);
         }
+        for (int l = 0; l < spot_lights.size(); l++) {
+            spot_light(l, 1.0f);
+        }
+        return;
     }
+    // light_samples lights picked by the light bvh, each weighted by the
+    // inverse of its probability, with stratified numbers of one dimension
+    sampler.SetDimension(BOUNCE_DIM + depth * DIMS_PER_BOUNCE + LIGHT_DIM);
+    float u = sampler.Get1D();
+    int n_samples = trace.light_samples;
+    for (int s = 0; s < n_samples; s++) {
+        int light;
+        float pmf;
+        if (!light_bvh.Sample(hit_p, hit_n, (s + u) / n_samples, light, pmf)) {
+            continue;
+        }
+        float weight = 1.0f / (pmf * n_samples);
+        if (light < n_point) {
+            point_light(light, weight);
+        } else {
+            spot_light(light - n_point, weight);
+        }
+    }
+}
+
+gm::Color RayTraceViewer::Shade(const gm::Ray &r, const Intersection &inter, int inst,
+        Sampler &sampler, int depth, const char *point_vis) {
+    gm::Vector3 hit_p = r.orig + r.dir * inter.t;
+    gm::Vector3 hit_n = inter.norm;
+    gm::Vector3 hit_t = inter.tan;
+    gm::Vector3 hit_b = gm::Cross(hit_n, hit_t);
+    gm::Matrix3 o2w(hit_t, hit_b, hit_n);
+    gm::Matrix3 w2o = gm::Transpose(o2w);
+    const gm::Color &f = trace.albedo[inst];
+
+    gm::Color L_out;
+    int n_dir = trace.dir_lights.size();
+    int n_point = trace.point_lights.size();
+    DirectLights(hit_p, hit_n, w2o, f, sampler, depth,
+        [&](const gm::Ray &shadow, const gm::Color &contrib, int light) {
+            int point = light - n_dir;
+            bool visible = point_vis && point >= 0 && point < n_point ? point_vis[point] :
+                !scene_bvh.Occluded(shadow);
+            if (visible) {
+                L_out += contrib;
+            }
+        });
 
-    
     float pdf;
     gm::Color fr = f;
-    gm::Vector3 w_in = Sample(pdf);
+    sampler.SetDimension(BOUNCE_DIM + depth * DIMS_PER_BOUNCE);
+    gm::Vector3 w_in = Sample(sampler, pdf);
 
     // Russian roulette
     float prob = 1.0;
     if (fr.Luminance() < 0.5) {
         prob = 0.5;
     }
-    if (rnd_real(rnd_gen) > prob) {
+    if (sampler.Get1D() > prob) {
         return L_out;
     }
 
     gm::Ray ri(hit_p, o2w * w_in);
-    gm::Color Li = Raytrace(ri, depth + 1);
+    gm::Color Li = Raytrace(ri, sampler, depth + 1);
     L_out += fr * Li * (std::abs(w_in[2]) / (pdf * prob));
 
     return L_out;
 }
 
+void RayTraceViewer::DrawWavefront(int i0, int j0, int h, int w, int n_samples) {
+    // all the paths of the tile go through each stage together, a bounce at a
+    // time, each worker keeps its buffers from tile to tile
+    static thread_local Wavefront wf;
+    GeneratePaths(wf, i0, j0, h, w, n_samples);
+    for (int depth = 0; depth < MAX_TRACE_DEPTH && !wf.active.empty(); depth++) {
+        ExtendPaths(wf);
+        ShadePaths(wf, depth);
+        ConnectShadowRays(wf);
+    }
+    AccumulatePaths(wf);
+}
+
+// stable counting sort of ids by the signs of the directions of their rays,
+// so that a packet of consecutive rays is coherent more often
+template <typename GetDir>
+static void SortByOctant(const std::vector<int> &ids, GetDir get_dir, std::vector<int> &order) {
+    int count[9] = {};
+    auto octant = [&get_dir](int id) {
+        const gm::Vector3 &d = get_dir(id);
+        return (d[0] < 0) | (d[1] < 0) << 1 | (d[2] < 0) << 2;
+    };
+    for (int id : ids) {
+        ++count[octant(id) + 1];
+    }
+    for (int o = 0; o < 8; o++) {
+        count[o + 1] += count[o];
+    }
+    order.resize(ids.size());
+    for (int id : ids) {
+        order[count[octant(id)]++] = id;
+    }
+}
+
+void RayTraceViewer::GeneratePaths(Wavefront &wf, int i0, int j0, int h, int w,
+        int n_samples) const {
+    // the paths of a block of pixels at the same sample are consecutive, like
+    // the packets of DrawQuad
+    PathStates &paths = wf.paths;
+    paths.Resize(h * w * n_samples);
+    wf.active.clear();
+    int n = 0;
+    for (int bi = 0; bi < h; bi += PACKET_H) {
+        for (int bj = 0; bj < w; bj += PACKET_W) {
+            for (int t = 0; t < n_samples; t++) {
+                for (int k = 0; k < PACKET_SIZE; k++) {
+                    if (bi + k / PACKET_W >= h || bj + k % PACKET_W >= w) continue;
+                    int i = i0 + bi + k / PACKET_W;
+                    int j = j0 + bj + k % PACKET_W;
+                    int ind = i * trace.width + j;
+                    if (converged[ind]) continue;
+                    uint32_t sample = spp[ind] + t;
+                    Sampler sampler(trace.sampler, ind, sample, trace.seed);
+                    sampler.SetDimension(CAMERA_DIM);
+                    auto [dx, dy] = sampler.Get2D();
+                    gm::Ray r = trace.cam->GenRay((j + dx) / trace.width, (i + dy) / trace.height);
+                    paths.orig[n] = r.orig;
+                    paths.dir[n] = r.dir;
+                    paths.throughput[n] = gm::Color(1.0f, 1.0f, 1.0f);
+                    paths.radiance[n] = gm::Color();
+                    paths.pixel[n] = ind;
+                    paths.sample[n] = sample;
+                    wf.active.push_back(n);
+                    ++n;
+                }
+            }
+        }
+    }
+    paths.Resize(n);
+}
+
+static gm::Ray PathRay(const PathStates &paths, int id) {
+    gm::Ray r;
+    r.orig = paths.orig[id];
+    r.dir = paths.dir[id];
+    return r;
+}
+
+void RayTraceViewer::ExtendPaths(Wavefront &wf) const {
+    PathStates &paths = wf.paths;
+    const std::vector<int> *ids = &wf.active;
+    if (trace.wavefront_sort) {
+        SortByOctant(wf.active, [&paths](int id) { return paths.dir[id]; }, wf.order);
+        ids = &wf.order;
+    }
+    wf.hit.clear();
+    RayPacket<PACKET_SIZE> p;
+    HitRecord hits[PACKET_SIZE];
+    int n = ids->size();
+    for (int b = 0; b < n; b += PACKET_SIZE) {
+        int m = std::min(PACKET_SIZE, n - b);
+        for (int k = 0; k < m; k++) {
+            p.rays[k] = PathRay(paths, (*ids)[b + k]);
+        }
+        uint32_t hit = scene_bvh.Intersect(p, (1u << m) - 1, hits);
+        for (int k = 0; k < m; k++) {
+            if (hit >> k & 1) {
+                int id = (*ids)[b + k];
+                paths.hits[id] = hits[k];
+                wf.hit.push_back(id);
+            }
+        }
+    }
+}
+
+void RayTraceViewer::ShadePaths(Wavefront &wf, int depth) const {
+    PathStates &paths = wf.paths;
+    // hits on the same instance are shaded together, so they interpolate
+    // the same geometry
+    if (trace.wavefront_sort) {
+        wf.keys.clear();
+        for (int id : wf.hit) {
+            wf.keys.push_back(uint64_t(paths.hits[id].inst) << 32 | uint32_t(id));
+        }
+        std::sort(wf.keys.begin(), wf.keys.end());
+        for (int k = 0; k < wf.keys.size(); k++) {
+            wf.hit[k] = int(wf.keys[k] & 0xffffffffu);
+        }
+    }
+
+    wf.active.clear();
+    wf.shadow.Clear();
+    for (int id : wf.hit) {
+        gm::Ray r = PathRay(paths, id);
+        Intersection inter;
+        scene_bvh.Interpolate(r, paths.hits[id], inter);
+        gm::Vector3 hit_p = r.orig + r.dir * inter.t;
+        gm::Vector3 hit_n = inter.norm;
+        gm::Vector3 hit_b = gm::Cross(hit_n, inter.tan);
+        gm::Matrix3 o2w(inter.tan, hit_b, hit_n);
+        gm::Matrix3 w2o = gm::Transpose(o2w);
+        const gm::Color &f = trace.albedo[paths.hits[id].inst];
+
+        Sampler sampler(trace.sampler, paths.pixel[id], paths.sample[id], trace.seed);
+        const gm::Color &throughput = paths.throughput[id];
+        DirectLights(hit_p, hit_n, w2o, f, sampler, depth,
+            [&wf, &throughput, id](const gm::Ray &shadow, const gm::Color &contrib, int) {
+                wf.shadow.Push(shadow, throughput * contrib, id);
+            });
+
+        // the bounce of the last depth would not be traced
+        if (depth + 1 >= MAX_TRACE_DEPTH) {
+            continue;
+        }
+        sampler.SetDimension(BOUNCE_DIM + depth * DIMS_PER_BOUNCE);
+        float pdf;
+        gm::Vector3 w_in = Sample(sampler, pdf);
+        float prob = 1.0;
+        if (f.Luminance() < 0.5) {
+            prob = 0.5;
+        }
+        if (sampler.Get1D() > prob) {
+            continue;
+        }
+        gm::Ray ri(hit_p, o2w * w_in);
+        paths.orig[id] = ri.orig;
+        paths.dir[id] = ri.dir;
+        paths.throughput[id] *= f * (std::abs(w_in[2]) / (pdf * prob));
+        wf.active.push_back(id);
+    }
+}
+
+void RayTraceViewer::ConnectShadowRays(Wavefront &wf) const {
+    ShadowQueue &shadow = wf.shadow;
+    int n = shadow.Size();
+    wf.shadow_ids.resize(n);
+    for (int s = 0; s < n; s++) {
+        wf.shadow_ids[s] = s;
+    }
+    const std::vector<int> *ids = &wf.shadow_ids;
+    if (trace.wavefront_sort) {
+        SortByOctant(wf.shadow_ids, [&shadow](int s) { return shadow.rays[s].dir; }, wf.order);
+        ids = &wf.order;
+    }
+
+    RayPacket<PACKET_SIZE> p;
+    for (int b = 0; b < n; b += PACKET_SIZE) {
+        int m = std::min(PACKET_SIZE, n - b);
+        for (int k = 0; k < m; k++) {
+            p.rays[k] = shadow.rays[(*ids)[b + k]];
+        }
+        uint32_t occluded = scene_bvh.Occluded(p, (1u << m) - 1);
+        for (int k = 0; k < m; k++) {
+            if (!(occluded >> k & 1)) {
+                int s = (*ids)[b + k];
+                wf.paths.radiance[shadow.path[s]] += shadow.contrib[s];
+            }
+        }
+    }
+}
+
+void RayTraceViewer::AccumulatePaths(const Wavefront &wf) {
+    const PathStates &paths = wf.paths;
+    for (int id = 0; id < paths.pixel.size(); id++) {
+        int ind = paths.pixel[id];
+        const gm::Color &col = paths.radiance[id];
+        accum[ind] += col;
+        accum_sq[ind] += col.Luminance() * col.Luminance();
+        ++spp[ind];
+    }
+}
+
 void RayTraceViewer::BuildBVH() {
-    std::vector<Primitive *> prims;
-    for (auto &mesh : config.scene->GetMeshes()) {
-        int M = mesh->GetIndexCount();
-        const unsigned int *p_ind = mesh->GetIndices();
-        for (int i = 0; i < M; i += 3) {
-            prims.push_back(new Triangle(mesh, p_ind[i], p_ind[i + 1], p_ind[i + 2]));
+    const SceneBVHUpdateInfo &info =
+        scene_bvh.Update(config.scene->GetMeshes(), config.accel);
+    if (info.refit_ms > 0.0) {
+        std::cout << "refit BVH: " << info.n_moved << " moved, " << info.refit_ms <<
+            " ms, sah x" << info.sah_growth << std::endl;
+    }
+    if (info.rebuild_ms > 0.0) {
+        std::cout << "rebuild BVH: " << info.rebuild_ms << " ms" << std::endl;
+    }
+}
+
+// camera rays of the sample for auto tuning, taken over a grid of pixels
+static const int tune_grid = 64;
+
+AcceleratorConfig RayTraceViewer::AutoTune() {
+    using Clock = std::chrono::steady_clock;
+    using Milliseconds = std::chrono::duration<double, std::milli>;
+
+    // camera rays, with one diffuse bounce and the point light shadow rays
+    // of each hit, like the first two bounces of a render
+    StopProgressive();
+    BuildBVH();
+    std::vector<gm::Ray> rays, shadow_rays;
+    for (int i = 0; i < tune_grid; i++) {
+        for (int j = 0; j < tune_grid; j++) {
+            Sampler sampler(config.sampler, i * tune_grid + j, 0, config.seed);
+            sampler.SetDimension(CAMERA_DIM);
+            auto [dx, dy] = sampler.Get2D();
+            float x = (j + dx) / tune_grid;
+            float y = (i + dy) / tune_grid;
+            gm::Ray r = config.cam->GenRay(x, y);
+            rays.push_back(r);
+            Intersection inter;
+            if (!scene_bvh.Intersect(r, inter)) continue;
+
+            gm::Vector3 hit_p = r.orig + r.dir * inter.t;
+            gm::Matrix3 o2w(inter.tan, gm::Cross(inter.norm, inter.tan), inter.norm);
+            float pdf;
+            sampler.SetDimension(BOUNCE_DIM);
+            rays.emplace_back(hit_p, o2w * Sample(sampler, pdf));
+            for (const auto &light : config.scene->GetPointLights()) {
+                shadow_rays.push_back(PointShadowRay(hit_p, inter.norm, light));
+            }
+        }
+    }
+
+    const auto &meshes = config.scene->GetMeshes();
+    auto measure = [&](const AcceleratorConfig &accel) {
+        auto start = Clock::now();
+        scene_bvh.Build(meshes, accel);
+        double build_ms = Milliseconds(Clock::now() - start).count();
+        // the best of a few runs, to filter out noise
+        double trace_ms = std::numeric_limits<double>::max();
+        for (int run = 0; run < 3; run++) {
+            start = Clock::now();
+            for (gm::Ray r : rays) {
+                Intersection inter;
+                scene_bvh.Intersect(r, inter);
+            }
+            for (const gm::Ray &r : shadow_rays) {
+                scene_bvh.Occluded(r);
+            }
+            trace_ms = std::min(trace_ms, Milliseconds(Clock::now() - start).count());
+        }
+        std::cout << "auto tune: ";
+        if (accel.type == AcceleratorType::Grid) {
+            std::cout << "grid, density " << accel.grid_density;
+        } else {
+            std::cout << "bvh, leaf size " << accel.bvh_params.max_leaf_size <<
+                ", bins " << accel.bvh_params.n_bins;
+        }
+        std::cout << ": build " << build_ms << " ms, trace " << trace_ms << " ms" << std::endl;
+        return trace_ms;
+    };
+
+    // leaf size first, then the bin count with the best leaf size, then grids
+    AcceleratorConfig best = config.accel;
+    double best_ms = std::numeric_limits<double>::max();
+    auto try_config = [&](const AcceleratorConfig &accel) {
+        double ms = measure(accel);
+        if (ms < best_ms) {
+            best = accel;
+            best_ms = ms;
         }
+    };
+    AcceleratorConfig accel = config.accel;
+    accel.type = AcceleratorType::BVH;
+    accel.bvh_params.n_bins = BVHBuildParams().n_bins;
+    for (int leaf_size : { 2, 4, 8, 16, 32 }) {
+        accel.bvh_params.max_leaf_size = leaf_size;
+        try_config(accel);
     }
+    accel = best;
+    for (int n_bins : { 8, 32 }) {
+        accel.bvh_params.n_bins = n_bins;
+        try_config(accel);
+    }
+    accel = config.accel;
+    accel.type = AcceleratorType::Grid;
+    for (float density : { 0.5f, 1.0f, 2.0f, 4.0f }) {
+        accel.grid_density = density;
+        try_config(accel);
+    }
+
+    config.accel = best;
+    scene_bvh.Build(meshes, best);
+    return best;
+}
+
+const SceneBVH &RayTraceViewer::GetSceneBVH() const {
+    return scene_bvh;
+}
+
+const BVHCounters &RayTraceViewer::GetCounters() const {
+    return counters;
+}
+
+double RayTraceViewer::GetTraceTime() const {
+    return trace_ms;
+}
+
+std::string RayTraceViewer::GetStatsJson() const {
+    return "{\n  \"instances\": " + std::to_string(scene_bvh.GetInstanceCount()) +
+        ",\n  \"top\": " + scene_bvh.GetTopStats().ToJson() +
+        ",\n  \"shapes\": " + scene_bvh.GetShapeStats().ToJson() +
+        ",\n  \"trace_ms\": " + std::to_string(trace_ms) +
+        ",\n  \"counters\": " + counters.ToJson() + "\n}\n";
+}
 
-    bvh_tree.Build(prims);
+void RayTraceViewer::SaveStats() const {
+    std::string filename = shot_path + "ray_trace_" + std::to_string(n_shot) + "_stats.json";
+    std::ofstream fout(filename);
+    fout << GetStatsJson();
+    std::cout << "stats saved to " << filename << std::endl;
 }
 
 void RayTraceViewer::SetColor(int i, int j, const gm::Color &col) {
-    int ind = ((config.height - i - 1) * config.width + j) * 3;
+    int ind = ((trace.height - i - 1) * trace.width + j) * 3;
     img[ind] = std::pow(col.r / (col.r + 1.0f), 1.0f/ 2.2f) * 255;
     img[ind + 1] = std::pow(col.g / (col.g + 1.0f), 1.0f/ 2.2f) * 255;
     img[ind + 2] = std::pow(col.b / (col.b + 1.0f), 1.0f/ 2.2f) * 255;
@@ -1,7 +1,15 @@
 #pragma once
 
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include "LightBVH.h"
+#include "Sampler.h"
 #include "Scene.h"
-#include "BVHTree.h"
+#include "SceneBVH.h"
+#include "Wavefront.h"
 
 namespace pepcy::renderer {
 
@@ -10,6 +18,29 @@ struct RayTraceViewerConfig {
     const Camera *cam;
     int width;
     int height;
+    AcceleratorConfig accel;
+    // count the bvh traversal work of each trace, slows tracing down a bit
+    bool count_traversal = false;
+    // random numbers of a pixel sample depend only on it and on the seed, so
+    // a trace is the same for any thread count
+    uint32_t seed = 0;
+    SamplerType sampler = SamplerType::Sobol;
+    // spend the samples on the pixels whose mean is not yet known within
+    // adaptive_threshold, relative to it, instead of evenly
+    bool adaptive = false;
+    float adaptive_threshold = 0.2f;
+    // trace the paths of a tile in stages, a bounce of all of them at a time,
+    // instead of each path to its end in turn
+    bool wavefront = false;
+    // sort the rays of a wavefront by the signs of their directions before
+    // tracing them, and the hits by instance before shading them, so that
+    // more packets are coherent, it does not pay off for diffuse bounces,
+    // whose rays start far apart
+    bool wavefront_sort = false;
+    // shade each hit with light_samples point or spot lights picked by a
+    // light bvh, instead of with all of them
+    bool sample_lights = false;
+    int light_samples = 1;
 };
 
 class RayTraceViewer {
@@ -18,26 +49,159 @@ class RayTraceViewer {
     ~RayTraceViewer();
 
     void BuildBVH();
+    // traces a small sample of the rays of a render against structures built
+    // with varied configs, builds the fastest one and returns its config
+    AcceleratorConfig AutoTune();
+    // traces the image on the tile scheduler, blocks until it is done
     void Draw();
+    // stops the trace in progress, the image is then not saved, thread safe
+    void Cancel();
+    // fraction of pixels traced by the current or the last trace, thread safe
+    float GetProgress() const;
     void SetColor(int i, int j, const gm::Color &col);
 
+    // traces one sample per pixel at a time on a background thread, into an
+    // accumulation buffer whose mean is the preview, until stopped
+    void StartProgressive();
+    void StopProgressive();
+    bool IsProgressive() const;
+    // restarts the progressive trace when the camera moved, the config, the
+    // lights, the materials or the meshes changed since it started, call once
+    // a frame
+    void Update();
+    // samples per pixel of the preview
+    int GetPassCount() const;
+    // copies the preview into pixels, rgb rows from the bottom, if it is newer
+    // than version, which is then updated, returns whether it was copied
+    bool GetPreview(uint64_t &version, std::vector<unsigned char> &pixels,
+        int &width, int &height) const;
+    // writes the preview, or the image of the last trace, and with adaptive
+    // sampling a heatmap of the samples per pixel next to it
+    void SaveImage();
+
     void SetConfig(const RayTraceViewerConfig &config);
     void Resize(int width, int height);
 
+    const SceneBVH &GetSceneBVH() const;
+    // traversal counters of the last trace, all 0 if it was not counted
+    const BVHCounters &GetCounters() const;
+    double GetTraceTime() const;
+    // bvh stats and counters of the last trace, as json
+    std::string GetStatsJson() const;
+    // writes GetStatsJson next to the image of the last trace
+    void SaveStats() const;
+
   private:
-    gm::Color Raytrace(const gm::Ray &r, int depth = 0);
-    void DrawQuad(int x0, int y0, int w, int h);
+    gm::Color Raytrace(const gm::Ray &r, Sampler &sampler, int depth = 0);
+    // shading of a hit, point_vis[l] tells whether point light l is visible
+    // from it, without point_vis the shadow rays are traced here
+    gm::Color Shade(const gm::Ray &r, const Intersection &inter, int inst, Sampler &sampler,
+        int depth, const char *point_vis = nullptr);
+    // calls visit(shadow_ray, contribution, light) for each light that lights
+    // the hit from above, or for the sampled ones, lights are numbered
+    // directional, point, then spot
+    template <typename Visit>
+    void DirectLights(const gm::Vector3 &hit_p, const gm::Vector3 &hit_n,
+        const gm::Matrix3 &w2o, const gm::Color &f, Sampler &sampler, int depth,
+        Visit visit) const;
+    // adds n_samples samples to each pixel of a tile that has not converged
+    void DrawQuad(int i0, int j0, int h, int w, int n_samples);
+    // DrawQuad as a wavefront, the stages below in turn
+    void DrawWavefront(int i0, int j0, int h, int w, int n_samples);
+    // camera rays of the samples of the tile
+    void GeneratePaths(Wavefront &wf, int i0, int j0, int h, int w, int n_samples) const;
+    // closest hits of the active paths, the paths that hit are queued to shade
+    void ExtendPaths(Wavefront &wf) const;
+    // queues the shadow rays of the hits, and the bounces of the paths that
+    // go on as the new active paths
+    void ShadePaths(Wavefront &wf, int depth) const;
+    // adds the light of the shadow rays that are not occluded to their paths
+    void ConnectShadowRays(Wavefront &wf) const;
+    void AccumulatePaths(const Wavefront &wf);
+    // takes the snapshot of a new trace and clears its buffers
+    void BeginTrace();
+    // tone maps the mean of the samples of each pixel into img, and copies
+    // their counts into img_spp
+    void Resolve();
+    // marks the pixels that have converged, returns how many have not
+    int UpdateConvergence();
+    void SaveHeatmap(const std::string &filename) const;
+    void Progressive();
 
     int n_shot = 0;
+    BVHCounters counters;
+    double trace_ms = 0.0;
 
     const static int MAX_TRACE_DEPTH = 4;
 
     RayTraceViewerConfig config;
-    unsigned char *img;
-    BVHTree bvh_tree;
+    SceneBVH scene_bvh;
+
+    // what tracing reads, taken from config when a trace starts, so that the
+    // ui may go on editing the config, the camera, the lights and the
+    // materials meanwhile
+    struct TraceState {
+        int width = 0;
+        int height = 0;
+        uint32_t seed = 0;
+        SamplerType sampler = SamplerType::Sobol;
+        bool adaptive = false;
+        float adaptive_threshold = 0.0f;
+        bool wavefront = false;
+        bool wavefront_sort = false;
+        bool sample_lights = false;
+        int light_samples = 1;
+        AcceleratorConfig accel;
+        std::optional<Camera> cam;
+        std::vector<DirectionalLight> dir_lights;
+        std::vector<PointLight> point_lights;
+        std::vector<SpotLight> spot_lights;
+        // albedo over pi of each instance of scene_bvh
+        std::vector<gm::Color> albedo;
+    } trace;
+    // sums of the samples of each pixel, and of their squared luminance
+    std::vector<gm::Color> accum;
+    std::vector<float> accum_sq;
+    std::vector<int> spp;
+    std::vector<char> converged;
+    std::vector<unsigned char> img;
+    // samples per pixel of img, spp goes on changing while a pass runs
+    std::vector<int> img_spp;
+    LightBVH light_bvh;
+
+    std::thread progressive_thread;
+    std::atomic<bool> progressive_stop = false;
+    std::atomic<int> n_passes = 0;
+    // guards img, img_spp and preview_version while a progressive trace runs
+    mutable std::mutex preview_mutex;
+    uint64_t preview_version = 0;
+
+    // tiles are split down to MIN_TILE_SIZE at the end of a trace, a multiple
+    // of the packet size
+    const static int TILE_SIZE = 32;
+    const static int MIN_TILE_SIZE = 8;
+
+    // camera rays of a block of pixels are traced as one packet
+    const static int PACKET_W = 4;
+    const static int PACKET_H = 4;
+    const static int PACKET_SIZE = PACKET_W * PACKET_H;
 
     const static int N_SAMPLES = 16;
-    float samples[N_SAMPLES][2];
+    const static int MAX_PASSES = 4096;
+
+    // dimensions of a pixel sample, the 2 of the camera jitter, then for each
+    // bounce 2 for the bsdf direction, 1 for russian roulette and at
+    // LIGHT_DIM 1 for the light samples
+    const static int CAMERA_DIM = 0;
+    const static int BOUNCE_DIM = 2;
+    const static int DIMS_PER_BOUNCE = 4;
+    const static int LIGHT_DIM = 3;
+
+    // adaptive sampling judges a pixel after MIN_ADAPTIVE_SPP samples, gives
+    // it at most ADAPTIVE_BATCH more at a time and stops at MAX_ADAPTIVE_SPP
+    const static int MIN_ADAPTIVE_SPP = 4;
+    const static int ADAPTIVE_BATCH = 4;
+    const static int MAX_ADAPTIVE_SPP = 4 * N_SAMPLES;
 };
 
 extern RayTraceViewer raytrace_viewer;
@@ -0,0 +1,174 @@
+#include "Sampler.h"
+
+#include <algorithm>
+
+namespace pepcy::renderer {
+
+static const int primes[Sampler::MAX_HALTON_DIM] = {
+    2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+    59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131
+};
+
+static uint32_t Hash(uint32_t a, uint32_t b) {
+    uint64_t x = (uint64_t(a) << 32 | b) * 0x9e3779b97f4a7c15ull;
+    x ^= x >> 32;
+    x *= 0xd6e8feb86659fd93ull;
+    x ^= x >> 32;
+    return uint32_t(x);
+}
+
+static uint32_t ReverseBits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// hash based owen scrambling of the bits of x, from the most significant one
+// (Burley, Practical Hash-based Owen Scrambling)
+static uint32_t OwenScramble(uint32_t x, uint32_t seed) {
+    x = ReverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return ReverseBits(x);
+}
+
+static float ToFloat(uint32_t x) {
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+// the second dimension of Sobol, the one of the polynomial x + 1, the first
+// one is van der Corput, the reversed bits of the index
+// it is linear in the bits of the index, so it is looked up a byte at a time
+struct Sobol2Table {
+    Sobol2Table() {
+        uint32_t v[32];
+        v[0] = 1u << 31;
+        for (int i = 1; i < 32; i++) {
+            v[i] = v[i - 1] ^ (v[i - 1] >> 1);
+        }
+        for (int b = 0; b < 4; b++) {
+            for (int x = 0; x < 256; x++) {
+                bytes[b][x] = 0;
+                for (int i = 0; i < 8; i++) {
+                    if (x >> i & 1) {
+                        bytes[b][x] ^= v[b * 8 + i];
+                    }
+                }
+            }
+        }
+    }
+
+    uint32_t bytes[4][256];
+};
+
+static const Sobol2Table sobol2_table;
+
+static uint32_t Sobol2(uint32_t index) {
+    return sobol2_table.bytes[0][index & 0xff] ^ sobol2_table.bytes[1][index >> 8 & 0xff] ^
+        sobol2_table.bytes[2][index >> 16 & 0xff] ^ sobol2_table.bytes[3][index >> 24];
+}
+
+// digits in the base of each Halton dimension that a float resolves, those
+// past them do not change the sample
+struct HaltonDigits {
+    HaltonDigits() {
+        for (int d = 0; d < Sampler::MAX_HALTON_DIM; d++) {
+            n[d] = 0;
+            for (uint64_t m = 1; m < (1ull << 24); m *= primes[d]) {
+                ++n[d];
+            }
+        }
+    }
+
+    int n[Sampler::MAX_HALTON_DIM];
+};
+
+static const HaltonDigits halton_digits;
+
+Sampler::Sampler(SamplerType type, uint32_t pixel, uint32_t sample, uint32_t seed) :
+        type(type), pixel_seed(Hash(pixel, seed)), sample(sample), rng(pixel, sample, seed) {}
+
+void Sampler::SetDimension(int dim) {
+    this->dim = dim;
+    // each dimension of random samples is a stream of its own, so they do not
+    // shift when a bounce uses fewer numbers
+    if (type == SamplerType::Random) {
+        rng = Rng(pixel_seed, sample, dim);
+    }
+}
+
+float Sampler::Get1D() {
+    float x;
+    if (type == SamplerType::Halton) {
+        x = Halton(dim);
+    } else if (type == SamplerType::Sobol) {
+        uint32_t seed = Hash(pixel_seed, dim);
+        x = ToFloat(OwenScramble(ReverseBits(OwenScramble(sample, seed)), Hash(seed, 1)));
+    } else {
+        x = rng.NextFloat();
+    }
+    ++dim;
+    return x;
+}
+
+std::pair<float, float> Sampler::Get2D() {
+    float x, y;
+    if (type == SamplerType::Halton) {
+        x = Halton(dim);
+        y = Halton(dim + 1);
+    } else if (type == SamplerType::Sobol) {
+        // both coordinates of one shuffled index, so that the pair is
+        // stratified in 2d and not only in each dimension, the shuffling keeps
+        // the points of any aligned run of 2^k indices, so prefixes stay
+        // stratified
+        uint32_t seed = Hash(pixel_seed, dim);
+        uint32_t index = OwenScramble(sample, seed);
+        x = ToFloat(OwenScramble(ReverseBits(index), Hash(seed, 1)));
+        y = ToFloat(OwenScramble(Sobol2(index), Hash(seed, 2)));
+    } else {
+        x = rng.NextFloat();
+        y = rng.NextFloat();
+    }
+    dim += 2;
+    return { x, y };
+}
+
+float Sampler::Halton(int dim) {
+    uint32_t seed = Hash(pixel_seed, dim);
+    if (dim >= MAX_HALTON_DIM) {
+        return ToFloat(Hash(seed, sample));
+    }
+    // in base 2 it is van der Corput, whose bits are scrambled at once
+    if (dim == 0) {
+        return ToFloat(OwenScramble(ReverseBits(sample), seed));
+    }
+    // radical inverse whose digits are each shifted by a hash of the digits
+    // before them, an owen scrambling
+    // the zero digits past the last nonzero one of the index are shifted as
+    // well, else samples differing only there would not be stratified
+    int base = primes[dim];
+    uint32_t a = sample;
+    uint32_t prefix = 0;
+    // summed in double, float rounding would move points across strata
+    double inv_base = 1.0 / base, scale = 1.0, res = 0.0;
+    for (int i = 0; i < halton_digits.n[dim]; i++) {
+        int digit = a % base;
+        a /= base;
+        digit = (digit + Hash(seed, prefix) % base) % base;
+        prefix = prefix * base + digit + 1;
+        scale *= inv_base;
+        res += digit * scale;
+    }
+    // the scrambled digits past those of any index are uniform given the ones
+    // before, so one random number stands for all of them
+    res += scale * ToFloat(Hash(seed, prefix));
+    return std::min(float(res), 0x1.fffffep-1f);
+}
+
+}
\ No newline at end of file
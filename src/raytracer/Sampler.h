@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+
+#include "Random.h"
+
+namespace pepcy::renderer {
+
+enum class SamplerType {
+    Random,
+    Halton,
+    Sobol
+};
+
+// the sample point of one pixel sample, one dimension at a time
+// Halton is owen scrambled in each dimension, Sobol is a 2d Sobol sequence
+// shuffled and owen scrambled anew for each dimension, both with per pixel
+// seeds, so pixels and dimensions are decorrelated while the samples of a
+// pixel stay stratified, every prefix of them included
+// callers place each use at a fixed dimension with SetDimension, so that a
+// dimension means the same thing in every sample of every pixel
+class Sampler {
+  public:
+    Sampler(SamplerType type, uint32_t pixel, uint32_t sample, uint32_t seed);
+
+    void SetDimension(int dim);
+    // next dimension, in [0, 1)
+    float Get1D();
+    // next two dimensions
+    std::pair<float, float> Get2D();
+
+    // dimensions past it are random in the Halton sampler
+    static constexpr int MAX_HALTON_DIM = 32;
+
+  private:
+    float Halton(int dim);
+
+    SamplerType type;
+    uint32_t pixel_seed;
+    uint32_t sample;
+    int dim = 0;
+    Rng rng;
+};
+
+}
\ No newline at end of file
@@ -0,0 +1,315 @@
+#include "SceneBVH.h"
+
+#include <chrono>
+#include <unordered_set>
+
+#include "RayPacket.h"
+
+namespace pepcy::renderer {
+
+// refitted top level is rebuilt once its sah cost grows over this factor
+static const float max_sah_growth = 1.3f;
+
+using Clock = std::chrono::steady_clock;
+using Milliseconds = std::chrono::duration<double, std::milli>;
+
+void SceneBVH::Build(const std::vector<Shape *> &shapes, const AcceleratorConfig &config) {
+    if (config != shape_config) {
+        shape_bvhs.clear();
+        shape_config = config;
+    }
+
+    // geometry of a shape never changes, but a cached bvh still refers to
+    // the shape it was built from, so drop it once that shape is gone
+    std::unordered_set<const Shape *> alive(shapes.begin(), shapes.end());
+    for (auto it = shape_bvhs.begin(); it != shape_bvhs.end(); ) {
+        const Shape *owner = it->second->GetShape();
+        if (!alive.count(owner) || !(owner->GetID() == it->first)) {
+            it = shape_bvhs.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    instances.clear();
+    std::vector<gm::BBox> bounds;
+    for (auto sh : shapes) {
+        if (sh->GetIndexCount() == 0) {
+            continue;
+        }
+        auto &blas = shape_bvhs[sh->GetID()];
+        if (!blas) {
+            if (config.analytic_shapes && sh->IsAnalytic()) {
+                blas = std::make_shared<ShapeSurface>();
+            } else if (config.type == AcceleratorType::Grid) {
+                blas = std::make_shared<ShapeGrid>();
+            } else {
+                blas = std::make_shared<ShapeBVH>();
+            }
+            blas->Build(sh, config);
+        }
+
+        Instance inst;
+        inst.sh = sh;
+        inst.id = sh->GetID();
+        inst.blas = blas;
+        inst.model = sh->GetModel();
+        inst.inv_model = Inverse(inst.model);
+        inst.bbox = inst.model.TransformBBox(blas->GetBBox());
+        instances.push_back(inst);
+        bounds.push_back(inst.bbox);
+    }
+    bvh.Build(bounds);
+    bvh4.Build(bvh);
+    built_cost = bvh.SAHCost();
+}
+
+bool SceneBVH::SameShapes(const std::vector<Shape *> &shapes) const {
+    int k = 0;
+    for (auto sh : shapes) {
+        if (sh->GetIndexCount() == 0) {
+            continue;
+        }
+        if (k == instances.size() || instances[k].sh != sh ||
+                !(instances[k].id == sh->GetID())) {
+            return false;
+        }
+        ++k;
+    }
+    return k == instances.size();
+}
+
+const SceneBVHUpdateInfo &SceneBVH::Update(const std::vector<Shape *> &shapes,
+        const AcceleratorConfig &config) {
+    info = SceneBVHUpdateInfo();
+    auto start = Clock::now();
+    if (config != shape_config || !SameShapes(shapes)) {
+        Build(shapes, config);
+        info.n_moved = instances.size();
+        info.rebuild_ms = Milliseconds(Clock::now() - start).count();
+        return info;
+    }
+
+    std::vector<gm::BBox> bounds(instances.size());
+    for (int i = 0; i < instances.size(); i++) {
+        Instance &inst = instances[i];
+        gm::Transform model = inst.sh->GetModel();
+        if (model != inst.model) {
+            inst.model = model;
+            inst.inv_model = Inverse(model);
+            inst.bbox = model.TransformBBox(inst.blas->GetBBox());
+            ++info.n_moved;
+        }
+        bounds[i] = inst.bbox;
+    }
+    if (info.n_moved == 0) {
+        return info;
+    }
+
+    bvh.Refit(bounds);
+    bvh4.Build(bvh);
+    info.sah_growth = built_cost > 0.0f ? bvh.SAHCost() / built_cost : 1.0f;
+    auto refit_end = Clock::now();
+    info.refit_ms = Milliseconds(refit_end - start).count();
+
+    if (info.sah_growth > max_sah_growth) {
+        bvh.Build(bounds);
+        bvh4.Build(bvh);
+        built_cost = bvh.SAHCost();
+        info.rebuild_ms = Milliseconds(Clock::now() - refit_end).count();
+    }
+    return info;
+}
+
+static gm::Ray ToObject(const Instance &inst, const gm::Ray &r, float &scale) {
+    gm::Vector3 dir = inst.inv_model.TransformVector(r.dir);
+    scale = dir.Norm();
+    gm::Ray r_obj(inst.inv_model.TransformPoint(r.orig), dir);
+    r_obj.t_min = r.t_min * scale;
+    r_obj.t_max = r.t_max * scale;
+    return r_obj;
+}
+
+bool SceneBVH::Intersect(const gm::Ray &r, Intersection &inter) const {
+    HitRecord hit;
+    if (!Intersect(r, hit)) {
+        return false;
+    }
+    Interpolate(r, hit, inter);
+    return true;
+}
+
+bool SceneBVH::Intersect(const gm::Ray &r, HitRecord &hit) const {
+    BVHCounterScope counters;
+    counters.rays = 1;
+    return bvh4.Intersect(r, [this, &r, &hit, &counters](int i) {
+        ++counters.instances;
+        const Instance &inst = instances[i];
+        float scale;
+        gm::Ray r_obj = ToObject(inst, r, scale);
+        if (!inst.blas->Intersect(r_obj, hit)) {
+            return false;
+        }
+        hit.t = r.t_max = r_obj.t_max / scale;
+        hit.inst = i;
+        return true;
+    });
+}
+
+void SceneBVH::Interpolate(const gm::Ray &r, const HitRecord &hit,
+        Intersection &inter) const {
+    const Instance &inst = instances[hit.inst];
+    float scale;
+    gm::Ray r_obj = ToObject(inst, r, scale);
+    // the recorded t is in world space
+    HitRecord local = hit;
+    local.t = hit.t * scale;
+    inst.blas->Interpolate(r_obj, local, inter);
+    inter.TransformedBy(inst.model);
+    inter.t = hit.t;
+    inter.prim = inst.sh;
+}
+
+bool SceneBVH::Occluded(const gm::Ray &r) const {
+    BVHCounterScope counters;
+    counters.rays = 1;
+    return bvh4.Occluded(r, [this, &r, &counters](int i) {
+        ++counters.instances;
+        float scale;
+        gm::Ray r_obj = ToObject(instances[i], r, scale);
+        return instances[i].blas->Occluded(r_obj);
+    });
+}
+
+template <int N>
+uint32_t SceneBVH::Intersect(RayPacket<N> &p, uint32_t mask,
+        Intersection *inters) const {
+    HitRecord hits[N];
+    uint32_t hit = Intersect(p, mask, hits);
+    for (int k = 0; k < N; k++) {
+        if (hit >> k & 1) {
+            Interpolate(p.rays[k], hits[k], inters[k]);
+        }
+    }
+    return hit;
+}
+
+template <int N>
+uint32_t SceneBVH::Intersect(RayPacket<N> &p, uint32_t mask, HitRecord *hits) const {
+    p.Setup(mask);
+    // packets with at most a quarter of their lanes active, like those of the
+    // pixels adaptive sampling has not finished, are faster one ray at a time
+    if (!p.coherent || LaneCount(mask) * 4 <= N) {
+        uint32_t hit = 0;
+        for (int k = 0; k < N; k++) {
+            if ((mask >> k & 1) && Intersect(p.rays[k], hits[k])) {
+                hit |= 1u << k;
+            }
+        }
+        return hit;
+    }
+
+    BVHCounterScope counters;
+    counters.rays = LaneCount(mask);
+    return bvh4.Intersect(p, mask, [this, &p, hits, &counters](int i, uint32_t m) {
+        const Instance &inst = instances[i];
+        RayPacket<N> q;
+        float scale[N];
+        for (int k = 0; k < N; k++) {
+            if (m >> k & 1) {
+                ++counters.instances;
+                q.rays[k] = ToObject(inst, p.rays[k], scale[k]);
+            }
+        }
+        q.Setup(m);
+        uint32_t hit = inst.blas->Intersect(q, m, hits);
+        for (int k = 0; k < N; k++) {
+            if (hit >> k & 1) {
+                hits[k].t = p.rays[k].t_max = q.rays[k].t_max / scale[k];
+                hits[k].inst = i;
+            }
+        }
+        return hit;
+    });
+}
+
+template <int N>
+uint32_t SceneBVH::Occluded(RayPacket<N> &p, uint32_t mask) const {
+    p.Setup(mask);
+    if (!p.coherent || LaneCount(mask) * 4 <= N) {
+        uint32_t occluded = 0;
+        for (int k = 0; k < N; k++) {
+            if ((mask >> k & 1) && Occluded(p.rays[k])) {
+                occluded |= 1u << k;
+            }
+        }
+        return occluded;
+    }
+
+    BVHCounterScope counters;
+    counters.rays = LaneCount(mask);
+    return bvh4.Occluded(p, mask, [this, &p, &counters](int i, uint32_t m) {
+        const Instance &inst = instances[i];
+        RayPacket<N> q;
+        float scale;
+        for (int k = 0; k < N; k++) {
+            if (m >> k & 1) {
+                ++counters.instances;
+                q.rays[k] = ToObject(inst, p.rays[k], scale);
+            }
+        }
+        q.Setup(m);
+        return inst.blas->Occluded(q, m);
+    });
+}
+
+template uint32_t SceneBVH::Intersect(RayPacket<4> &, uint32_t, Intersection *) const;
+template uint32_t SceneBVH::Intersect(RayPacket<8> &, uint32_t, Intersection *) const;
+template uint32_t SceneBVH::Intersect(RayPacket<16> &, uint32_t, Intersection *) const;
+template uint32_t SceneBVH::Intersect(RayPacket<4> &, uint32_t, HitRecord *) const;
+template uint32_t SceneBVH::Intersect(RayPacket<8> &, uint32_t, HitRecord *) const;
+template uint32_t SceneBVH::Intersect(RayPacket<16> &, uint32_t, HitRecord *) const;
+template uint32_t SceneBVH::Occluded(RayPacket<4> &, uint32_t) const;
+template uint32_t SceneBVH::Occluded(RayPacket<8> &, uint32_t) const;
+template uint32_t SceneBVH::Occluded(RayPacket<16> &, uint32_t) const;
+
+int SceneBVH::GetInstanceCount() const {
+    return instances.size();
+}
+
+const Instance &SceneBVH::GetInstance(int i) const {
+    return instances[i];
+}
+
+int SceneBVH::GetShapeBVHCount() const {
+    return shape_bvhs.size();
+}
+
+bool SceneBVH::IsUpToDate(const std::vector<Shape *> &shapes) const {
+    if (!SameShapes(shapes)) {
+        return false;
+    }
+    for (const auto &inst : instances) {
+        if (inst.sh->GetModel() != inst.model) {
+            return false;
+        }
+    }
+    return true;
+}
+
+BVHStats SceneBVH::GetTopStats() const {
+    // the binary tree is kept for refitting
+    BVHStats stats = bvh.GetStats();
+    stats.memory += bvh4.GetMemory() + instances.capacity() * sizeof(Instance);
+    return stats;
+}
+
+BVHStats SceneBVH::GetShapeStats() const {
+    BVHStats stats;
+    for (const auto &[id, blas] : shape_bvhs) {
+        stats.Add(blas->GetStats());
+    }
+    return stats;
+}
+
+}
\ No newline at end of file
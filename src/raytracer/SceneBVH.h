@@ -0,0 +1,85 @@
+#pragma once
+
+#include <memory>
+#include <unordered_map>
+
+#include "ShapeBVH.h"
+#include "ShapeGrid.h"
+#include "ShapeSurface.h"
+
+namespace pepcy::renderer {
+
+// a shape placed in the scene, rays are moved into its object space once and
+// then traced against the shared bvh of its geometry
+struct Instance {
+    const Shape *sh;
+    gid::GID id;
+    std::shared_ptr<const Accelerator> blas;
+    gm::Transform model, inv_model;
+    gm::BBox bbox;
+};
+
+// what the last SceneBVH::Update did, times are 0 for skipped steps
+struct SceneBVHUpdateInfo {
+    int n_moved = 0;
+    float sah_growth = 1.0f;
+    double refit_ms = 0.0;
+    double rebuild_ms = 0.0;
+};
+
+// two-level bvh, a top level bvh over instances and a bottom level
+// accelerator per distinct geometry, shapes with the same GID share it
+class SceneBVH {
+  public:
+    // bottom levels are kept between builds, so moving shapes only rebuilds
+    // the top level
+    // config selects the structure of the bottom levels, the top level is
+    // always a full precision bvh, as it is refitted in place
+    void Build(const std::vector<Shape *> &shapes, const AcceleratorConfig &config);
+    // if the same shapes are in the scene and only their transforms changed,
+    // the top level is refitted and only rebuilt once refitting made its
+    // sah cost grow too much, otherwise the same as Build
+    const SceneBVHUpdateInfo &Update(const std::vector<Shape *> &shapes,
+        const AcceleratorConfig &config);
+
+    bool Intersect(const gm::Ray &r, Intersection &inter) const;
+    // closest hit without its shading attributes, which Interpolate fetches
+    bool Intersect(const gm::Ray &r, HitRecord &hit) const;
+    // any hit, for shadow rays
+    bool Occluded(const gm::Ray &r) const;
+    // packet versions, return the lanes that hit and the occluded lanes
+    // packets whose rays differ in direction signs, or with a single active
+    // lane, are traced ray by ray
+    template <int N>
+    uint32_t Intersect(RayPacket<N> &p, uint32_t mask, Intersection *inters) const;
+    template <int N>
+    uint32_t Intersect(RayPacket<N> &p, uint32_t mask, HitRecord *hits) const;
+    template <int N>
+    uint32_t Occluded(RayPacket<N> &p, uint32_t mask) const;
+
+    // world space intersection of a hit of r
+    void Interpolate(const gm::Ray &r, const HitRecord &hit, Intersection &inter) const;
+
+    int GetInstanceCount() const;
+    const Instance &GetInstance(int i) const;
+    int GetShapeBVHCount() const;
+    // whether shapes are the ones built with, at the same transforms
+    bool IsUpToDate(const std::vector<Shape *> &shapes) const;
+    // stats of the top level, and of all bottom levels merged together
+    BVHStats GetTopStats() const;
+    BVHStats GetShapeStats() const;
+
+  private:
+    bool SameShapes(const std::vector<Shape *> &shapes) const;
+
+    std::vector<Instance> instances;
+    BVHTree bvh;
+    BVH4 bvh4;
+    float built_cost = 0.0f;
+    SceneBVHUpdateInfo info;
+
+    std::unordered_map<gid::GID, std::shared_ptr<Accelerator>, gid::GIDHasher> shape_bvhs;
+    AcceleratorConfig shape_config;
+};
+
+}
\ No newline at end of file
@@ -0,0 +1,147 @@
+#include "ShapeBVH.h"
+
+#include <chrono>
+
+#include "RayPacket.h"
+
+namespace pepcy::renderer {
+
+using Clock = std::chrono::steady_clock;
+using Milliseconds = std::chrono::duration<double, std::milli>;
+
+void ShapeBVH::Build(const Shape *sh, const AcceleratorConfig &config) {
+    auto start = Clock::now();
+    SetShape(sh);
+    int M = sh->GetIndexCount();
+    const unsigned int *p_ind = sh->GetIndices();
+    std::vector<gm::BBox> bounds = GetTriangleBounds();
+    BVHBuildParams params = config.bvh_params;
+    params.prim_block = TriangleSoup::BLOCK;
+    BVHTree tree;
+    if (config.bvh_build == BVHBuildMethod::SBVH) {
+        std::vector<gm::Vector3> points;
+        points.reserve(M);
+        for (int i = 0; i < M; i++) {
+            points.push_back(sh->GetPosition(p_ind[i]));
+        }
+        tree.BuildSpatial(points, params);
+    } else {
+        tree.Build(bounds, config.bvh_build, params);
+    }
+    // leaves index the soup directly and are tested a block at a time
+    bvh.Build(tree, config.bvh_compressed, TriangleSoup::BLOCK);
+    soup.Build(sh, bvh.GetIndices());
+    bvh.UseLeafOrder();
+    stats = tree.GetStats();
+    stats.memory = bvh.GetMemory() + soup.GetMemory();
+    stats.build_ms = Milliseconds(Clock::now() - start).count();
+}
+
+bool ShapeBVH::Intersect(const gm::Ray &r, HitRecord &hit) const {
+    BVHCounterScope counters;
+    TriangleRay ray(r);
+    int slot = -1;
+    float u, v;
+    bvh.IntersectLeaves(r, [this, &ray, &r, &slot, &u, &v, &counters](int first, int n) {
+        counters.triangles += n;
+        int i = soup.Intersect(ray, r, first, n, u, v);
+        if (i >= 0) {
+            slot = i;
+            return true;
+        }
+        return false;
+    });
+    if (slot < 0) {
+        return false;
+    }
+    hit.t = r.t_max;
+    hit.u = u;
+    hit.v = v;
+    hit.prim = soup.GetTriangle(slot);
+    return true;
+}
+
+bool ShapeBVH::Occluded(const gm::Ray &r) const {
+    BVHCounterScope counters;
+    TriangleRay ray(r);
+    return bvh.OccludedLeaves(r, [this, &ray, &r, &counters](int first, int n) {
+        counters.triangles += n;
+        return soup.Occluded(ray, r, first, n);
+    });
+}
+
+template <int N>
+uint32_t ShapeBVH::IntersectPacket(RayPacket<N> &p, uint32_t mask,
+        HitRecord *hits) const {
+    BVHCounterScope counters;
+    // each lane tests the leaf a block at a time
+    int slots[N];
+    auto leaf = [this, &p, hits, &slots, &counters](int first, int n, uint32_t m) {
+        uint32_t hit = 0;
+        for (int k = 0; k < N; k++) {
+            if (!(m >> k & 1)) continue;
+            counters.triangles += n;
+            int i = soup.Intersect(TriangleRay(p.rays[k]), p.rays[k], first, n,
+                hits[k].u, hits[k].v);
+            if (i >= 0) {
+                slots[k] = i;
+                hit |= 1u << k;
+            }
+        }
+        return hit;
+    };
+    uint32_t ret = bvh.IntersectLeaves(p, mask, leaf);
+    for (int k = 0; k < N; k++) {
+        if (ret >> k & 1) {
+            hits[k].t = p.rays[k].t_max;
+            hits[k].prim = soup.GetTriangle(slots[k]);
+        }
+    }
+    return ret;
+}
+
+template <int N>
+uint32_t ShapeBVH::OccludedPacket(RayPacket<N> &p, uint32_t mask) const {
+    BVHCounterScope counters;
+    return bvh.OccludedLeaves(p, mask, [this, &p, &counters](int first, int n, uint32_t m) {
+        uint32_t hit = 0;
+        for (int k = 0; k < N; k++) {
+            if (!(m >> k & 1)) continue;
+            counters.triangles += n;
+            if (soup.Occluded(TriangleRay(p.rays[k]), p.rays[k], first, n)) {
+                hit |= 1u << k;
+            }
+        }
+        return hit;
+    });
+}
+
+uint32_t ShapeBVH::Intersect(RayPacket<4> &p, uint32_t mask, HitRecord *hits) const {
+    return IntersectPacket(p, mask, hits);
+}
+
+uint32_t ShapeBVH::Intersect(RayPacket<8> &p, uint32_t mask, HitRecord *hits) const {
+    return IntersectPacket(p, mask, hits);
+}
+
+uint32_t ShapeBVH::Intersect(RayPacket<16> &p, uint32_t mask, HitRecord *hits) const {
+    return IntersectPacket(p, mask, hits);
+}
+
+uint32_t ShapeBVH::Occluded(RayPacket<4> &p, uint32_t mask) const {
+    return OccludedPacket(p, mask);
+}
+
+uint32_t ShapeBVH::Occluded(RayPacket<8> &p, uint32_t mask) const {
+    return OccludedPacket(p, mask);
+}
+
+uint32_t ShapeBVH::Occluded(RayPacket<16> &p, uint32_t mask) const {
+    return OccludedPacket(p, mask);
+}
+
+gm::BBox ShapeBVH::GetBBox() const {
+    return bvh.GetBBox();
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "Accelerator.h"
+#include "BVH4.h"
+
+namespace pepcy::renderer {
+
+// bottom level bvh over the triangles of a shape, in its object space
+class ShapeBVH : public Accelerator {
+  public:
+    void Build(const Shape *sh, const AcceleratorConfig &config) override;
+
+    bool Intersect(const gm::Ray &r, HitRecord &hit) const override;
+    bool Occluded(const gm::Ray &r) const override;
+    uint32_t Intersect(RayPacket<4> &p, uint32_t mask, HitRecord *hits) const override;
+    uint32_t Intersect(RayPacket<8> &p, uint32_t mask, HitRecord *hits) const override;
+    uint32_t Intersect(RayPacket<16> &p, uint32_t mask, HitRecord *hits) const override;
+    uint32_t Occluded(RayPacket<4> &p, uint32_t mask) const override;
+    uint32_t Occluded(RayPacket<8> &p, uint32_t mask) const override;
+    uint32_t Occluded(RayPacket<16> &p, uint32_t mask) const override;
+
+    gm::BBox GetBBox() const override;
+
+  private:
+    template <int N>
+    uint32_t IntersectPacket(RayPacket<N> &p, uint32_t mask, HitRecord *hits) const;
+    template <int N>
+    uint32_t OccludedPacket(RayPacket<N> &p, uint32_t mask) const;
+
+    BVH4 bvh;
+};
+
+}
\ No newline at end of file
@@ -0,0 +1,232 @@
+#include "ShapeGrid.h"
+
+#include <chrono>
+#include <cmath>
+
+namespace pepcy::renderer {
+
+// cells with more triangles than this get a sub grid
+static const int sub_grid_min_size = 8;
+static const int max_top_res = 256;
+static const int max_sub_res = 16;
+
+using Clock = std::chrono::steady_clock;
+using Milliseconds = std::chrono::duration<double, std::milli>;
+
+void ShapeGrid::SetupGrid(Grid &g, const gm::BBox &bbox, int n, float density,
+        int max_res, int first_cell) {
+    g.bbox = bbox;
+    g.first_cell = first_cell;
+    gm::Vector3 ext = bbox.p_max - bbox.p_min;
+    // cells are close to cubes, about density * n of them in total
+    float k = std::cbrt(density * n / (ext[0] * ext[1] * ext[2]));
+    for (int d = 0; d < 3; d++) {
+        g.res[d] = std::clamp(int(ext[d] * k + 0.5f), 1, max_res);
+        g.cell_size[d] = ext[d] / g.res[d];
+    }
+}
+
+void ShapeGrid::BinTriangles(const Grid &g, const std::vector<gm::BBox> &bounds,
+        const int *ids, int n, std::vector<int> &offsets, std::vector<int> &list) {
+    // triangles go to every cell their bounds overlap, clamped to the grid
+    auto cell_range = [&g](const gm::BBox &b, int *lo, int *hi) {
+        for (int d = 0; d < 3; d++) {
+            lo[d] = std::clamp(int((b.p_min[d] - g.bbox.p_min[d]) / g.cell_size[d]),
+                0, g.res[d] - 1);
+            hi[d] = std::clamp(int((b.p_max[d] - g.bbox.p_min[d]) / g.cell_size[d]),
+                0, g.res[d] - 1);
+        }
+    };
+    auto for_cells = [&g](const int *lo, const int *hi, auto &&func) {
+        for (int z = lo[2]; z <= hi[2]; z++) {
+            for (int y = lo[1]; y <= hi[1]; y++) {
+                for (int x = lo[0]; x <= hi[0]; x++) {
+                    func((z * g.res[1] + y) * g.res[0] + x);
+                }
+            }
+        }
+    };
+
+    int n_cells = g.res[0] * g.res[1] * g.res[2];
+    offsets.assign(n_cells + 1, 0);
+    for (int i = 0; i < n; i++) {
+        int lo[3], hi[3];
+        cell_range(bounds[ids[i]], lo, hi);
+        for_cells(lo, hi, [&offsets](int id) { ++offsets[id + 1]; });
+    }
+    for (int i = 0; i < n_cells; i++) {
+        offsets[i + 1] += offsets[i];
+    }
+    list.resize(offsets[n_cells]);
+    std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+    for (int i = 0; i < n; i++) {
+        int lo[3], hi[3];
+        cell_range(bounds[ids[i]], lo, hi);
+        for_cells(lo, hi, [&](int id) { list[fill[id]++] = ids[i]; });
+    }
+}
+
+void ShapeGrid::Build(const Shape *sh, const AcceleratorConfig &config) {
+    auto start = Clock::now();
+    SetShape(sh);
+    cells.clear();
+    subs.clear();
+    refs.clear();
+    top = Grid();
+
+    int N = n_tris;
+    std::vector<gm::BBox> bounds = GetTriangleBounds();
+    gm::BBox bbox;
+    for (const gm::BBox &b : bounds) {
+        bbox.Expand(b);
+    }
+    std::vector<int> ids(N);
+    for (int i = 0; i < N; i++) {
+        ids[i] = i;
+    }
+    soup.Build(sh, ids);
+    stats = BVHStats();
+    stats.n_trees = 1;
+    stats.n_prims = N;
+    if (N > 0) {
+        // flat bounds get some thickness, so that every cell has a volume
+        gm::Vector3 ext = bbox.p_max - bbox.p_min;
+        float eps = std::max({ ext[0], ext[1], ext[2], 1.0f }) * 1e-3f;
+        for (int d = 0; d < 3; d++) {
+            if (ext[d] < eps) {
+                bbox.p_min[d] -= eps * 0.5f;
+                bbox.p_max[d] += eps * 0.5f;
+            }
+        }
+
+        SetupGrid(top, bbox, N, config.grid_density, max_top_res, 0);
+        std::vector<int> offsets, list;
+        BinTriangles(top, bounds, ids.data(), N, offsets, list);
+
+        int n_top = top.res[0] * top.res[1] * top.res[2];
+        cells.resize(n_top);
+        std::vector<int> sub_offsets, sub_list;
+        for (int i = 0; i < n_top; i++) {
+            int begin = offsets[i], n = offsets[i + 1] - begin;
+            if (n <= sub_grid_min_size) {
+                cells[i] = { int(refs.size()), n };
+                refs.insert(refs.end(), list.begin() + begin, list.begin() + begin + n);
+                continue;
+            }
+
+            int x = i % top.res[0], y = i / top.res[0] % top.res[1], z = i / top.res[0] / top.res[1];
+            gm::BBox cbox;
+            cbox.p_min = bbox.p_min + gm::Vector3(float(x), float(y), float(z)) * top.cell_size;
+            cbox.p_max = cbox.p_min + top.cell_size;
+            Grid sub;
+            SetupGrid(sub, cbox, n, config.grid_density, max_sub_res, cells.size());
+            cells[i] = { 0, -1 - int(subs.size()) };
+            subs.push_back(sub);
+
+            BinTriangles(sub, bounds, list.data() + begin, n, sub_offsets, sub_list);
+            int n_sub = sub.res[0] * sub.res[1] * sub.res[2];
+            for (int j = 0; j < n_sub; j++) {
+                int sb = sub_offsets[j], sn = sub_offsets[j + 1] - sb;
+                cells.push_back({ int(refs.size()), sn });
+                refs.insert(refs.end(), sub_list.begin() + sb, sub_list.begin() + sb + sn);
+            }
+        }
+
+        // cells count as nodes, non-empty ones as leaves at depth 0 or 1
+        stats.n_nodes = cells.size();
+        stats.n_refs = refs.size();
+        stats.max_depth = subs.empty() ? 0 : 1;
+        stats.depth_hist.assign(stats.max_depth + 1, 0);
+        for (int i = 0; i < cells.size(); i++) {
+            if (cells[i].count <= 0) continue;
+            ++stats.n_leaves;
+            ++stats.depth_hist[i < n_top ? 0 : 1];
+            if (stats.leaf_size_hist.size() <= cells[i].count) {
+                stats.leaf_size_hist.resize(cells[i].count + 1);
+            }
+            ++stats.leaf_size_hist[cells[i].count];
+        }
+    }
+    stats.memory = cells.capacity() * sizeof(Cell) + refs.capacity() * sizeof(int) +
+        subs.capacity() * sizeof(Grid) + soup.GetMemory();
+    stats.build_ms = Milliseconds(Clock::now() - start).count();
+}
+
+bool ShapeGrid::Intersect(const gm::Ray &r, HitRecord &hit) const {
+    float t0;
+    if (cells.empty() || !BVHRay(r).Intersect(top.bbox, r.t_min, r.t_max, t0)) {
+        return false;
+    }
+
+    // a triangle may be hit beyond the cell it is found in, so the walk only
+    // stops once the next cell starts beyond the closest hit
+    BVHCounterScope counters;
+    TriangleRay ray(r);
+    int slot = -1;
+    float u, v;
+    auto test = [this, &ray, &r, &slot, &u, &v, &counters](int id, float t_enter, float) {
+        if (t_enter > r.t_max) {
+            return true;
+        }
+        ++counters.nodes;
+        const Cell &c = cells[id];
+        for (int i = 0; i < c.count; i++) {
+            ++counters.triangles;
+            if (soup.Intersect(ray, r, refs[c.offset + i], u, v)) {
+                slot = refs[c.offset + i];
+            }
+        }
+        return false;
+    };
+    Walk(top, r, t0, r.t_max, [this, &r, &test](int id, float t_enter, float t_exit) {
+        if (cells[id].count >= 0) {
+            return test(id, t_enter, t_exit);
+        }
+        if (t_enter > r.t_max) {
+            return true;
+        }
+        Walk(subs[-1 - cells[id].count], r, t_enter, t_exit, test);
+        return false;
+    });
+    if (slot < 0) {
+        return false;
+    }
+    hit.t = r.t_max;
+    hit.u = u;
+    hit.v = v;
+    hit.prim = soup.GetTriangle(slot);
+    return true;
+}
+
+bool ShapeGrid::Occluded(const gm::Ray &r) const {
+    float t0;
+    if (cells.empty() || !BVHRay(r).Intersect(top.bbox, r.t_min, r.t_max, t0)) {
+        return false;
+    }
+
+    BVHCounterScope counters;
+    TriangleRay ray(r);
+    auto test = [this, &ray, &r, &counters](int id, float, float) {
+        ++counters.nodes;
+        const Cell &c = cells[id];
+        for (int i = 0; i < c.count; i++) {
+            ++counters.triangles;
+            if (soup.Occluded(ray, r, refs[c.offset + i])) {
+                return true;
+            }
+        }
+        return false;
+    };
+    return Walk(top, r, t0, r.t_max, [this, &r, &test](int id, float t_enter, float t_exit) {
+        if (cells[id].count >= 0) {
+            return test(id, t_enter, t_exit);
+        }
+        return Walk(subs[-1 - cells[id].count], r, t_enter, t_exit, test);
+    });
+}
+
+gm::BBox ShapeGrid::GetBBox() const {
+    return top.bbox;
+}
+
+}
\ No newline at end of file
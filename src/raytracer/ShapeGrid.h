@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+
+#include "Accelerator.h"
+
+namespace pepcy::renderer {
+
+// two-level uniform grid over the triangles of a shape, in its object space
+// top level cells holding many triangles are split by a grid of their own
+class ShapeGrid : public Accelerator {
+  public:
+    void Build(const Shape *sh, const AcceleratorConfig &config) override;
+
+    using Accelerator::Intersect;
+    using Accelerator::Occluded;
+    bool Intersect(const gm::Ray &r, HitRecord &hit) const override;
+    bool Occluded(const gm::Ray &r) const override;
+
+    gm::BBox GetBBox() const override;
+
+  private:
+    struct Grid {
+        gm::BBox bbox;
+        gm::Vector3 cell_size;
+        int res[3];
+        int first_cell; // cells of a grid are stored x first, then y, then z
+    };
+    // holds the triangles refs[offset, offset + count), or count is
+    // -1 - index of the sub grid splitting the cell
+    struct Cell {
+        int offset;
+        int count;
+    };
+
+    static void SetupGrid(Grid &g, const gm::BBox &bbox, int n, float density,
+        int max_res, int first_cell);
+    // triangles in each cell of g, as offsets into list
+    static void BinTriangles(const Grid &g, const std::vector<gm::BBox> &bounds,
+        const int *ids, int n, std::vector<int> &offsets, std::vector<int> &list);
+    // visits the cells of g pierced by r within [t0, t1] front to back,
+    // func(cell, t_enter, t_exit) returns true to stop the walk
+    template <typename Func>
+    static bool Walk(const Grid &g, const gm::Ray &r, float t0, float t1, Func &&func);
+
+    Grid top;
+    std::vector<Grid> subs;
+    std::vector<Cell> cells;
+    std::vector<int> refs;
+};
+
+template <typename Func>
+bool ShapeGrid::Walk(const Grid &g, const gm::Ray &r, float t0, float t1, Func &&func) {
+    int c[3], step[3], out[3];
+    float next[3], delta[3];
+    gm::Vector3 p = r.orig + r.dir * t0;
+    for (int d = 0; d < 3; d++) {
+        float rel = (p[d] - g.bbox.p_min[d]) / g.cell_size[d];
+        c[d] = std::clamp(int(rel), 0, g.res[d] - 1);
+        if (r.dir[d] > 0.0f) {
+            step[d] = 1;
+            out[d] = g.res[d];
+            next[d] = (g.bbox.p_min[d] + (c[d] + 1) * g.cell_size[d] - r.orig[d]) / r.dir[d];
+            delta[d] = g.cell_size[d] / r.dir[d];
+        } else if (r.dir[d] < 0.0f) {
+            step[d] = -1;
+            out[d] = -1;
+            next[d] = (g.bbox.p_min[d] + c[d] * g.cell_size[d] - r.orig[d]) / r.dir[d];
+            delta[d] = -g.cell_size[d] / r.dir[d];
+        } else {
+            step[d] = 0;
+            out[d] = -1;
+            next[d] = std::numeric_limits<float>::infinity();
+            delta[d] = 0.0f;
+        }
+    }
+
+    float t_enter = t0;
+    while (true) {
+        int a = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+        float t_exit = std::min(next[a], t1);
+        int id = g.first_cell + (c[2] * g.res[1] + c[1]) * g.res[0] + c[0];
+        if (func(id, t_enter, t_exit)) {
+            return true;
+        }
+        if (next[a] >= t1) {
+            return false;
+        }
+        c[a] += step[a];
+        if (c[a] == out[a]) {
+            return false;
+        }
+        t_enter = next[a];
+        next[a] += delta[a];
+    }
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,61 @@
+#include "ShapeSurface.h"
+
+#include <chrono>
+
+namespace pepcy::renderer {
+
+using Clock = std::chrono::steady_clock;
+using Milliseconds = std::chrono::duration<double, std::milli>;
+
+void ShapeSurface::Build(const Shape *sh, const AcceleratorConfig &config) {
+    auto start = Clock::now();
+    SetShape(sh);
+    stats = BVHStats();
+    stats.n_trees = 1;
+    stats.n_leaves = 1;
+    stats.n_prims = 1;
+    stats.n_refs = 1;
+    stats.depth_hist = { 1 };
+    stats.leaf_size_hist = { 0, 1 };
+    stats.sah_cost = 1.0f;
+    stats.memory = sizeof(ShapeSurface);
+    stats.build_ms = Milliseconds(Clock::now() - start).count();
+}
+
+bool ShapeSurface::Intersect(const gm::Ray &r, HitRecord &hit) const {
+    BVHCounterScope counters;
+    ++counters.triangles;
+    int part;
+    if (!sh->IntersectSurface(r, part)) {
+        return false;
+    }
+    hit.t = r.t_max;
+    hit.u = hit.v = 0.0f;
+    hit.prim = part;
+    return true;
+}
+
+bool ShapeSurface::Occluded(const gm::Ray &r) const {
+    BVHCounterScope counters;
+    ++counters.triangles;
+    gm::Ray r_ = r;
+    int part;
+    return sh->IntersectSurface(r_, part);
+}
+
+gm::BBox ShapeSurface::GetBBox() const {
+    return sh->GetLocalBBox();
+}
+
+void ShapeSurface::Interpolate(const gm::Ray &r, const HitRecord &hit,
+        Intersection &inter) const {
+    sh->GetSurfaceFrame(r.orig + r.dir * hit.t, hit.prim, inter.norm, inter.tan);
+    if (gm::Dot(inter.norm, r.dir) > 0) {
+        inter.norm = -inter.norm;
+        inter.tan = -inter.tan;
+    }
+    inter.t = hit.t;
+    inter.prim = sh;
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "Accelerator.h"
+
+namespace pepcy::renderer {
+
+// a shape with an exact surface, see Shape::IsAnalytic, which is intersected
+// directly instead of through its triangles
+class ShapeSurface : public Accelerator {
+  public:
+    void Build(const Shape *sh, const AcceleratorConfig &config) override;
+
+    using Accelerator::Intersect;
+    using Accelerator::Occluded;
+    bool Intersect(const gm::Ray &r, HitRecord &hit) const override;
+    bool Occluded(const gm::Ray &r) const override;
+
+    gm::BBox GetBBox() const override;
+
+    // hit.prim holds the part of the surface hit
+    void Interpolate(const gm::Ray &r, const HitRecord &hit, Intersection &inter) const override;
+};
+
+}
\ No newline at end of file
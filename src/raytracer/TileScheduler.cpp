@@ -0,0 +1,206 @@
+#include "TileScheduler.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace pepcy::renderer {
+
+TileScheduler::TileScheduler(int n_workers) {
+    if (n_workers <= 0) {
+        n_workers = std::max<int>(std::thread::hardware_concurrency(), 1);
+    }
+    for (int i = 0; i < n_workers; i++) {
+        workers.push_back(std::make_unique<Worker>());
+    }
+    for (int i = 0; i < n_workers; i++) {
+        workers[i]->thread = std::thread([this, i]() { WorkerLoop(i); });
+    }
+}
+
+TileScheduler::~TileScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    start_cv.notify_all();
+    for (auto &worker : workers) {
+        worker->thread.join();
+    }
+}
+
+TileScheduler &TileScheduler::Get() {
+    // a function local static, so the workers are joined before the statics
+    // they may touch at thread exit, which were all constructed earlier
+    static TileScheduler scheduler;
+    return scheduler;
+}
+
+bool TileScheduler::Run(int height, int width, int tile_size, int min_tile_size,
+        const std::function<void(const Tile &)> &func,
+        const std::function<void(float)> &on_progress, int interval_ms) {
+    std::lock_guard<std::mutex> run_lock(run_mutex);
+    tile_size = std::max(tile_size, 1);
+    this->min_tile_size = std::clamp(min_tile_size, 1, tile_size);
+    this->func = &func;
+    n_pixels = int64_t(height) * width;
+    n_drawn = 0;
+    cancelled = false;
+
+    std::vector<Tile> tiles;
+    for (int i = 0; i < height; i += tile_size) {
+        for (int j = 0; j < width; j += tile_size) {
+            tiles.push_back({ i, j, std::min(tile_size, height - i), std::min(tile_size, width - j) });
+        }
+    }
+    // each worker starts with a contiguous run of tiles in scanline order, so
+    // that the tiles it draws are close together
+    int n_workers = workers.size();
+    int n_tiles = tiles.size();
+    for (int k = 0; k < n_workers; k++) {
+        Worker &worker = *workers[k];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        int first = int64_t(n_tiles) * k / n_workers;
+        int last = int64_t(n_tiles) * (k + 1) / n_workers;
+        worker.tiles.assign(tiles.begin() + first, tiles.begin() + last);
+    }
+    n_queued = n_tiles;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        n_running = n_workers;
+        ++generation;
+    }
+    start_cv.notify_all();
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!done_cv.wait_for(lock, std::chrono::milliseconds(interval_ms),
+                [this]() { return n_running == 0; })) {
+            if (on_progress) {
+                lock.unlock();
+                on_progress(GetProgress());
+                lock.lock();
+            }
+        }
+    }
+
+    // a cancelled run leaves tiles behind
+    for (auto &worker : workers) {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        worker->tiles.clear();
+    }
+    this->func = nullptr;
+    return !cancelled;
+}
+
+void TileScheduler::Cancel() {
+    cancelled = true;
+}
+
+float TileScheduler::GetProgress() const {
+    int64_t total = n_pixels.load();
+    return total > 0 ? float(double(n_drawn.load()) / total) : 1.0f;
+}
+
+int TileScheduler::GetWorkerCount() const {
+    return workers.size();
+}
+
+void TileScheduler::WorkerLoop(int id) {
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start_cv.wait(lock, [this, seen]() { return quit || generation != seen; });
+            if (quit) {
+                return;
+            }
+            seen = generation;
+        }
+
+        Tile tile;
+        while (!cancelled && n_queued > 0) {
+            if (!Pop(id, tile) && !Steal(id, tile)) {
+                // the last tiles are being split by other workers
+                std::this_thread::yield();
+                continue;
+            }
+            Split(id, tile);
+            --n_queued;
+            (*func)(tile);
+            n_drawn += int64_t(tile.h) * tile.w;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--n_running == 0) {
+            done_cv.notify_all();
+        }
+    }
+}
+
+bool TileScheduler::Pop(int id, Tile &tile) {
+    Worker &worker = *workers[id];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if (worker.tiles.empty()) {
+        return false;
+    }
+    tile = worker.tiles.back();
+    worker.tiles.pop_back();
+    return true;
+}
+
+bool TileScheduler::Steal(int id, Tile &tile) {
+    int n_workers = workers.size();
+    for (int k = 1; k < n_workers; k++) {
+        Worker &victim = *workers[(id + k) % n_workers];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tiles.empty()) {
+            tile = victim.tiles.front();
+            victim.tiles.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void TileScheduler::Split(int id, Tile &tile) {
+    if (n_queued >= int64_t(workers.size())) {
+        return;
+    }
+    // halves rounded up to whole min_tile_size, a side is kept when it can not
+    // be split
+    auto half = [this](int len) {
+        if (len <= min_tile_size) {
+            return len;
+        }
+        int h = len / 2;
+        return (h + min_tile_size - 1) / min_tile_size * min_tile_size;
+    };
+    int h0 = half(tile.h);
+    int w0 = half(tile.w);
+    if (h0 >= tile.h && w0 >= tile.w) {
+        return;
+    }
+
+    Tile pieces[3];
+    int n_pieces = 0;
+    if (w0 < tile.w) {
+        pieces[n_pieces++] = { tile.i0, tile.j0 + w0, h0, tile.w - w0 };
+    }
+    if (h0 < tile.h) {
+        pieces[n_pieces++] = { tile.i0 + h0, tile.j0, tile.h - h0, w0 };
+    }
+    if (w0 < tile.w && h0 < tile.h) {
+        pieces[n_pieces++] = { tile.i0 + h0, tile.j0 + w0, tile.h - h0, tile.w - w0 };
+    }
+    // counted before they can be stolen, so the count never drops to 0 early
+    n_queued += n_pieces;
+    {
+        Worker &worker = *workers[id];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.tiles.insert(worker.tiles.end(), pieces, pieces + n_pieces);
+    }
+    tile.h = h0;
+    tile.w = w0;
+}
+
+}
\ No newline at end of file
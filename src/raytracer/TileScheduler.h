@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace pepcy::renderer {
+
+// a rectangle of pixels, rows [i0, i0 + h) and columns [j0, j0 + w)
+struct Tile {
+    int i0, j0;
+    int h, w;
+};
+
+// a fixed pool of workers, one per hardware thread, that draws the tiles of an
+// image, each worker takes tiles from its own deque and steals from the others
+// when it runs out
+// tiles are split when few are left, so that no worker idles at the end of a
+// frame while another finishes a large, expensive tile
+class TileScheduler {
+  public:
+    explicit TileScheduler(int n_workers = 0);
+    ~TileScheduler();
+
+    TileScheduler(const TileScheduler &) = delete;
+    TileScheduler &operator=(const TileScheduler &) = delete;
+
+    // calls func on tiles covering a height x width image, from the workers,
+    // and blocks until all of them are drawn or the run is cancelled
+    // tiles are at most tile_size wide and are split down to min_tile_size,
+    // both should be multiples of the block the drawing works on
+    // on_progress, if given, is called on the calling thread every interval_ms
+    // with the fraction of pixels drawn
+    // returns false if the run was cancelled
+    bool Run(int height, int width, int tile_size, int min_tile_size,
+        const std::function<void(const Tile &)> &func,
+        const std::function<void(float)> &on_progress = nullptr, int interval_ms = 500);
+    // stops the current run, tiles already started are finished, thread safe
+    void Cancel();
+    // fraction of pixels drawn by the current or the last run, thread safe
+    float GetProgress() const;
+    int GetWorkerCount() const;
+
+    // the pool shared by all renders, started on first use
+    static TileScheduler &Get();
+
+  private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Tile> tiles;
+        std::thread thread;
+    };
+
+    void WorkerLoop(int id);
+    // next tile of worker id, its own newest one, or the oldest one of another
+    bool Pop(int id, Tile &tile);
+    bool Steal(int id, Tile &tile);
+    // splits the tile into quadrants when few tiles are left, the tile keeps
+    // one of them and the others go to the deque of worker id
+    void Split(int id, Tile &tile);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    std::mutex run_mutex; // one run at a time
+    std::mutex mutex;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    uint64_t generation = 0;
+    int n_running = 0;
+    bool quit = false;
+
+    const std::function<void(const Tile &)> *func = nullptr;
+    int min_tile_size = 1;
+    // tiles in the deques, or taken but neither split nor started yet, workers
+    // leave the run when it drops to 0
+    std::atomic<int64_t> n_queued = 0;
+    std::atomic<int64_t> n_drawn = 0;
+    std::atomic<int64_t> n_pixels = 0;
+    std::atomic<bool> cancelled = false;
+};
+
+}
\ No newline at end of file
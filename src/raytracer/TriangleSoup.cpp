@@ -0,0 +1,34 @@
+#include "TriangleSoup.h"
+
+namespace pepcy::renderer {
+
+void TriangleSoup::Build(const Shape *sh, const std::vector<int> &order) {
+    int n = order.size();
+    n_blocks = (n + BLOCK - 1) / BLOCK;
+    // padding slots stay zero, which no ray hits
+    blocks.reset(new Block[n_blocks]());
+
+    ids = order;
+    const unsigned int *p_ind = sh->GetIndices();
+    for (int i = 0; i < n; i++) {
+        if (order[i] < 0) continue;
+        Block &b = blocks[i / BLOCK];
+        int j = i % BLOCK;
+        for (int k = 0; k < 3; k++) {
+            gm::Vector3 p = sh->GetPosition(p_ind[3 * order[i] + k]);
+            for (int d = 0; d < 3; d++) {
+                b.p[k][d][j] = p[d];
+            }
+        }
+    }
+}
+
+int TriangleSoup::GetSize() const {
+    return ids.size();
+}
+
+size_t TriangleSoup::GetMemory() const {
+    return sizeof(Block) * n_blocks + ids.capacity() * sizeof(int);
+}
+
+}
\ No newline at end of file
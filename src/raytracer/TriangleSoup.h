@@ -0,0 +1,227 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include "BVH4.h"
+#include "Triangle.h"
+
+namespace pepcy::renderer {
+
+// per ray setup of the watertight ray/triangle test, the axis along which
+// the ray is longest becomes z and the ray is sheared onto it
+struct TriangleRay {
+    explicit TriangleRay(const gm::Ray &r) : orig(r.orig) {
+        gm::Vector3 a(std::abs(r.dir[0]), std::abs(r.dir[1]), std::abs(r.dir[2]));
+        kz = a[0] > a[1] ? (a[0] > a[2] ? 0 : 2) : (a[1] > a[2] ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        // keeps the winding, so the signs of the edge functions are consistent
+        if (r.dir[kz] < 0.0f) {
+            std::swap(kx, ky);
+        }
+        sx = r.dir[kx] / r.dir[kz];
+        sy = r.dir[ky] / r.dir[kz];
+        sz = 1.0f / r.dir[kz];
+    }
+
+    gm::Vector3 orig;
+    int kx, ky, kz;
+    float sx, sy, sz;
+};
+
+// vertex positions of triangles baked for intersection, so tests need neither
+// the shape nor any index lookups
+// triangles are stored in blocks of BLOCK in SoA layout and tested a block at
+// a time, rows of a block are 16-byte aligned for the SSE loads
+// the test is watertight: rays never slip through edges shared by triangles,
+// and edge-on triangles are always missed
+class TriangleSoup {
+  public:
+    // slot i holds triangle order[i] of sh, a triangle may be stored in several
+    // slots, slots with negative order are padding that is never hit
+    void Build(const Shape *sh, const std::vector<int> &order);
+
+    // closest hit among the slots [first, first + n), first must start a block
+    // shrinks r.t_max and returns the slot hit, or -1
+    // u and v weight the second and the third vertex, as in Triangle::Interpolate
+    int Intersect(const TriangleRay &ray, const gm::Ray &r, int first, int n,
+        float &u, float &v) const;
+    bool Occluded(const TriangleRay &ray, const gm::Ray &r, int first, int n) const;
+    // the same for slot i alone
+    bool Intersect(const TriangleRay &ray, const gm::Ray &r, int i, float &u, float &v) const;
+    bool Occluded(const TriangleRay &ray, const gm::Ray &r, int i) const;
+
+    // triangle of the shape held by slot i
+    int GetTriangle(int i) const;
+    int GetSize() const;
+    size_t GetMemory() const;
+
+    static constexpr int BLOCK = BVH4::WIDTH;
+
+  private:
+    // x, y, z of the 3 vertices for the triangles of a block, 144 bytes, so
+    // 16-byte alignment needs no padding
+    struct alignas(16) Block {
+        float p[3][3][BLOCK];
+    };
+
+    // lanes of block b hit within [r.t_min, r.t_max], with their t, u and v
+    uint32_t TestBlock(const TriangleRay &ray, const gm::Ray &r, int b, uint32_t lanes,
+        float *t, float *u, float *v) const;
+    bool TestSlot(const TriangleRay &ray, const gm::Ray &r, int b, int j,
+        float &t, float &u, float &v) const;
+
+    std::unique_ptr<Block[]> blocks;
+    std::vector<int> ids;
+    int n_blocks = 0;
+};
+
+inline bool TriangleSoup::TestSlot(const TriangleRay &ray, const gm::Ray &r, int b, int j,
+        float &t, float &u, float &v) const {
+    const Block &blk = blocks[b];
+    float ax[3], ay[3], az[3];
+    for (int k = 0; k < 3; k++) {
+        float px = blk.p[k][ray.kx][j] - ray.orig[ray.kx];
+        float py = blk.p[k][ray.ky][j] - ray.orig[ray.ky];
+        float pz = blk.p[k][ray.kz][j] - ray.orig[ray.kz];
+        ax[k] = px - ray.sx * pz;
+        ay[k] = py - ray.sy * pz;
+        az[k] = ray.sz * pz;
+    }
+    float e0 = ax[2] * ay[1] - ay[2] * ax[1];
+    float e1 = ax[0] * ay[2] - ay[0] * ax[2];
+    float e2 = ax[1] * ay[0] - ay[1] * ax[0];
+    // an edge through the ray is decided in double, so that both triangles
+    // sharing it agree
+    if (e0 == 0.0f || e1 == 0.0f || e2 == 0.0f) {
+        e0 = float(double(ax[2]) * ay[1] - double(ay[2]) * ax[1]);
+        e1 = float(double(ax[0]) * ay[2] - double(ay[0]) * ax[2]);
+        e2 = float(double(ax[1]) * ay[0] - double(ay[1]) * ax[0]);
+    }
+    if ((e0 < 0.0f || e1 < 0.0f || e2 < 0.0f) && (e0 > 0.0f || e1 > 0.0f || e2 > 0.0f)) {
+        return false;
+    }
+    float det = e0 + e1 + e2;
+    if (det == 0.0f) {
+        return false;
+    }
+    float inv_det = 1.0f / det;
+    t = (e0 * az[0] + e1 * az[1] + e2 * az[2]) * inv_det;
+    u = e1 * inv_det;
+    v = e2 * inv_det;
+    return !(t < r.t_min || t > r.t_max);
+}
+
+inline uint32_t TriangleSoup::TestBlock(const TriangleRay &ray, const gm::Ray &r, int b,
+        uint32_t lanes, float *t, float *u, float *v) const {
+#ifdef PEPCY_BVH4_SSE
+    const Block &blk = blocks[b];
+    __m128 ox = _mm_set1_ps(ray.orig[ray.kx]);
+    __m128 oy = _mm_set1_ps(ray.orig[ray.ky]);
+    __m128 oz = _mm_set1_ps(ray.orig[ray.kz]);
+    __m128 sx = _mm_set1_ps(ray.sx);
+    __m128 sy = _mm_set1_ps(ray.sy);
+    __m128 sz = _mm_set1_ps(ray.sz);
+    __m128 ax[3], ay[3], az[3];
+    for (int k = 0; k < 3; k++) {
+        __m128 px = _mm_sub_ps(_mm_load_ps(blk.p[k][ray.kx]), ox);
+        __m128 py = _mm_sub_ps(_mm_load_ps(blk.p[k][ray.ky]), oy);
+        __m128 pz = _mm_sub_ps(_mm_load_ps(blk.p[k][ray.kz]), oz);
+        ax[k] = _mm_sub_ps(px, _mm_mul_ps(sx, pz));
+        ay[k] = _mm_sub_ps(py, _mm_mul_ps(sy, pz));
+        az[k] = _mm_mul_ps(sz, pz);
+    }
+    __m128 e0 = _mm_sub_ps(_mm_mul_ps(ax[2], ay[1]), _mm_mul_ps(ay[2], ax[1]));
+    __m128 e1 = _mm_sub_ps(_mm_mul_ps(ax[0], ay[2]), _mm_mul_ps(ay[0], ax[2]));
+    __m128 e2 = _mm_sub_ps(_mm_mul_ps(ax[1], ay[0]), _mm_mul_ps(ay[1], ax[0]));
+
+    __m128 zero = _mm_setzero_ps();
+    // lanes with an edge through the ray go through the exact scalar test
+    uint32_t exact = _mm_movemask_ps(_mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(e0, zero),
+        _mm_cmpeq_ps(e1, zero)), _mm_cmpeq_ps(e2, zero))) & lanes;
+    __m128 neg = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(e0, zero), _mm_cmplt_ps(e1, zero)),
+        _mm_cmplt_ps(e2, zero));
+    __m128 pos = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(e0, zero), _mm_cmpgt_ps(e1, zero)),
+        _mm_cmpgt_ps(e2, zero));
+    __m128 det = _mm_add_ps(_mm_add_ps(e0, e1), e2);
+    __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+    __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e0, az[0]), _mm_mul_ps(e1, az[1])),
+        _mm_mul_ps(e2, az[2])), inv_det);
+    __m128 ok = _mm_andnot_ps(_mm_and_ps(neg, pos), _mm_cmpneq_ps(det, zero));
+    ok = _mm_and_ps(ok, _mm_cmpge_ps(tt, _mm_set1_ps(r.t_min)));
+    ok = _mm_and_ps(ok, _mm_cmple_ps(tt, _mm_set1_ps(r.t_max)));
+    uint32_t hit = _mm_movemask_ps(ok) & lanes & ~exact;
+    _mm_storeu_ps(t, tt);
+    _mm_storeu_ps(u, _mm_mul_ps(e1, inv_det));
+    _mm_storeu_ps(v, _mm_mul_ps(e2, inv_det));
+    for (int j = 0; exact != 0; j++, exact >>= 1) {
+        if ((exact & 1) && TestSlot(ray, r, b, j, t[j], u[j], v[j])) {
+            hit |= 1u << j;
+        }
+    }
+    return hit;
+#else
+    uint32_t hit = 0;
+    for (int j = 0; j < BLOCK; j++) {
+        if ((lanes >> j & 1) && TestSlot(ray, r, b, j, t[j], u[j], v[j])) {
+            hit |= 1u << j;
+        }
+    }
+    return hit;
+#endif
+}
+
+inline int TriangleSoup::Intersect(const TriangleRay &ray, const gm::Ray &r, int first, int n,
+        float &u, float &v) const {
+    int hit = -1;
+    for (int i = 0; i < n; i += BLOCK) {
+        uint32_t lanes = n - i >= BLOCK ? (1u << BLOCK) - 1 : (1u << (n - i)) - 1;
+        float bt[BLOCK], bu[BLOCK], bv[BLOCK];
+        uint32_t m = TestBlock(ray, r, (first + i) / BLOCK, lanes, bt, bu, bv);
+        for (int j = 0; m != 0; j++, m >>= 1) {
+            if ((m & 1) && bt[j] <= r.t_max) {
+                r.t_max = bt[j];
+                u = bu[j];
+                v = bv[j];
+                hit = first + i + j;
+            }
+        }
+    }
+    return hit;
+}
+
+inline bool TriangleSoup::Occluded(const TriangleRay &ray, const gm::Ray &r, int first,
+        int n) const {
+    for (int i = 0; i < n; i += BLOCK) {
+        uint32_t lanes = n - i >= BLOCK ? (1u << BLOCK) - 1 : (1u << (n - i)) - 1;
+        float bt[BLOCK], bu[BLOCK], bv[BLOCK];
+        if (TestBlock(ray, r, (first + i) / BLOCK, lanes, bt, bu, bv) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool TriangleSoup::Intersect(const TriangleRay &ray, const gm::Ray &r, int i,
+        float &u, float &v) const {
+    float t;
+    if (!TestSlot(ray, r, i / BLOCK, i % BLOCK, t, u, v)) {
+        return false;
+    }
+    r.t_max = t;
+    return true;
+}
+
+inline bool TriangleSoup::Occluded(const TriangleRay &ray, const gm::Ray &r, int i) const {
+    float t, u, v;
+    return TestSlot(ray, r, i / BLOCK, i % BLOCK, t, u, v);
+}
+
+inline int TriangleSoup::GetTriangle(int i) const {
+    return ids[i];
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Accelerator.h"
+
+namespace pepcy::renderer {
+
+// state of the paths of a wavefront, one entry per path in each array, so
+// that a stage only touches the fields it needs
+struct PathStates {
+    void Resize(int n) {
+        orig.resize(n);
+        dir.resize(n);
+        throughput.resize(n);
+        radiance.resize(n);
+        hits.resize(n);
+        pixel.resize(n);
+        sample.resize(n);
+    }
+
+    std::vector<gm::Vector3> orig;
+    std::vector<gm::Vector3> dir;
+    std::vector<gm::Color> throughput;
+    // sum of the light the path has gathered, weighted by its throughput
+    std::vector<gm::Color> radiance;
+    std::vector<HitRecord> hits;
+    // pixel of the tile the path belongs to and its sample in that pixel
+    std::vector<int> pixel;
+    std::vector<uint32_t> sample;
+};
+
+// shadow rays of a shading stage, with what each adds to its path if the
+// light is visible
+struct ShadowQueue {
+    void Clear() {
+        rays.clear();
+        contrib.clear();
+        path.clear();
+    }
+
+    void Push(const gm::Ray &r, const gm::Color &c, int p) {
+        rays.push_back(r);
+        contrib.push_back(c);
+        path.push_back(p);
+    }
+
+    int Size() const {
+        return rays.size();
+    }
+
+    std::vector<gm::Ray> rays;
+    std::vector<gm::Color> contrib;
+    std::vector<int> path;
+};
+
+// the buffers of the wavefront of a tile, kept by each worker from tile to
+// tile
+struct Wavefront {
+    PathStates paths;
+    // paths to extend, and those whose extension hit a surface
+    std::vector<int> active;
+    std::vector<int> hit;
+    ShadowQueue shadow;
+    std::vector<int> shadow_ids;
+    // scratch of the sorts
+    std::vector<int> order;
+    std::vector<uint64_t> keys;
+};
+
+}
\ No newline at end of file
@@ -1,5 +1,8 @@
 #include "BasicShape.h"
 
+#include <cmath>
+#include <utility>
+
 namespace pepcy::renderer {
 
 Cube::Cube() {
@@ -93,7 +96,7 @@ Sphere::Sphere() {
     } else {
         id = g_gid;
     }
-    bbox = gm::BBox(gm::Vector3(-0.5f, -0.5f, -0.5f), gm::Vector3(0.5f, 0.5f, 0.5f));
+    bbox = gm::BBox(gm::Vector3(-1.0f, -1.0f, -1.0f), gm::Vector3(1.0f, 1.0f, 1.0f));
     bbox_valid = true;
 
     const int Y_COUNT = 24;
@@ -138,71 +141,89 @@ Sphere::Sphere() {
     }
 }
 
-/*
-static gm::Vector3 GetSphereTangent(gm::Vector3 &norm) {
-    float xt = norm[2] * norm[2] / (norm[0] * norm[0] + norm[2] * norm[2]);
-    float zt = std::sqrt(1 - xt);
-    xt = std::sqrt(xt);
-    gm::Vector3 tan(xt, 0.0f, zt);
-    if (norm[0] >= 0 && norm[2] > 0) {
-        tan[0] = -xt;
-        tan[2] = zt;
-    } else if (norm[0] < 0 && norm[2] >= 0) {
-        tan[0] = -xt;
-        tan[2] = -zt;
-    } else if (norm[0] <= 0 && norm[2] < 0) {
-        tan[0] = xt;
-        tan[2] = -zt;
+// roots of a t^2 + 2 b t + c = 0 in increasing order, the discriminant is
+// computed from the distance of the ray to the center, which is far more
+// precise than b^2 - a c for distant rays
+static int SolveQuadratic(float a, float b, float c, float dist2, float radius2, float *t) {
+    if (a == 0.0f) {
+        return 0;
+    }
+    float disc = a * (radius2 - dist2);
+    if (disc < 0.0f) {
+        return 0;
+    }
+    float q = -b - std::copysign(std::sqrt(disc), b);
+    if (q == 0.0f) {
+        t[0] = t[1] = 0.0f;
+        return 2;
     }
-    return tan;
+    t[0] = q / a;
+    t[1] = c / q;
+    if (t[0] > t[1]) {
+        std::swap(t[0], t[1]);
+    }
+    return 2;
 }
-static bool SphereTest(const Sphere &s, const gm::Ray &r, float &t0, float &t1) {
+
+// hits of a sphere, both roots are returned so that callers can clip them
+static int SphereRoots(const gm::Ray &r, const gm::Vector3 &center, float radius, float *t) {
+    gm::Vector3 oc = r.orig - center;
     float a = r.dir.Norm2();
-    float b = gm::Dot(r.orig, r.dir);
-    float c = r.orig.Norm2() - 1.0f;
-    float disc = b * b - a * c;
-    if (disc > 0) {
-        float sqrtd = sqrt(disc);
-        t0 = (-b - sqrtd) / a;
-        t1 = (-b + sqrtd) / a;
-        return true;
+    float b = gm::Dot(oc, r.dir);
+    float c = oc.Norm2() - radius * radius;
+    gm::Vector3 l = oc - r.dir * (b / a);
+    return SolveQuadratic(a, b, c, l.Norm2(), radius * radius, t);
+}
+
+// hits of an infinite cylinder around the y axis
+static int CylinderRoots(const gm::Ray &r, float radius, float *t) {
+    float a = r.dir[0] * r.dir[0] + r.dir[2] * r.dir[2];
+    if (a == 0.0f) {
+        return 0;
     }
-    return false;
+    float b = r.orig[0] * r.dir[0] + r.orig[2] * r.dir[2];
+    float c = r.orig[0] * r.orig[0] + r.orig[2] * r.orig[2] - radius * radius;
+    float lx = r.orig[0] - r.dir[0] * (b / a);
+    float lz = r.orig[2] - r.dir[2] * (b / a);
+    return SolveQuadratic(a, b, c, lx * lx + lz * lz, radius * radius, t);
 }
-bool Sphere::Intersect(const gm::Ray &r_) const {
-    auto trans = model;
-    gm::Ray r = trans.InvTransformRay(r_);
-    float t0, t1;
-    if (SphereTest(*this, r, t0, t1)) {
-        return !(t0 > r.t_max || t1 < r.t_min);
+
+// tangent along the texture u of the basic shapes, which goes around y
+static gm::Vector3 TangentAroundY(const gm::Vector3 &p) {
+    float len = std::sqrt(p[0] * p[0] + p[2] * p[2]);
+    if (len == 0.0f) {
+        return gm::Vector3(0.0f, 0.0f, 1.0f);
     }
-    return false;
+    return gm::Vector3(-p[2] / len, 0.0f, p[0] / len);
 }
-bool Sphere::Intersect(const gm::Ray &r_, Intersection &inter) const {
-    auto trans = model;
-    gm::Ray r = trans.InvTransformRay(r_);
-    float t0, t1;
-    if (SphereTest(*this, r, t0, t1)) {
-        if (t0 > r.t_max || t1 < r.t_min) {
-            return false;
-        }
-        inter.prim = this;
-        if (t0 > r.t_min) {
-            r.t_max = t0;
-            inter.norm = gm::Normalize(r.orig + r.dir * t0);
-        } else {
-            r.t_max = t1;
-            inter.norm = gm::Normalize(r.orig + r.dir * t1);
+
+static bool InRange(const gm::Ray &r, float t) {
+    return !(t < r.t_min || t > r.t_max);
+}
+
+bool Sphere::IsAnalytic() const {
+    return true;
+}
+
+bool Sphere::IntersectSurface(const gm::Ray &r, int &part) const {
+    float t[2];
+    int n = SphereRoots(r, gm::Vector3(0.0f), 1.0f, t);
+    for (int i = 0; i < n; i++) {
+        if (InRange(r, t[i])) {
+            r.t_max = t[i];
+            part = 0;
+            return true;
         }
-        inter.tan = GetSphereTangent(inter.norm);
-        r = trans.TransformRay(r);
-        inter.TransformedBy(trans);
-        inter.t = r_.t_max = r.t_max;
-        return true;
     }
     return false;
 }
-*/
+
+void Sphere::GetSurfaceFrame(const gm::Vector3 &p, int part, gm::Vector3 &norm,
+        gm::Vector3 &tan) const {
+    norm = gm::Normalize(p);
+    tan = TangentAroundY(p);
+}
+
 
 Plane::Plane() {
     static bool init_id = true;
@@ -372,6 +393,48 @@ Cylinder::Cylinder() {
     }
 }
 
+bool Cylinder::IsAnalytic() const {
+    return true;
+}
+
+bool Cylinder::IntersectSurface(const gm::Ray &r, int &part) const {
+    bool flag = false;
+    float t[2];
+    int n = CylinderRoots(r, 1.0f, t);
+    for (int i = 0; i < n; i++) {
+        float y = r.orig[1] + r.dir[1] * t[i];
+        if (InRange(r, t[i]) && std::abs(y) <= 0.5f) {
+            r.t_max = t[i];
+            part = 0;
+            flag = true;
+            break;
+        }
+    }
+    // caps, part 1 at the top and 2 at the bottom
+    if (r.dir[1] != 0.0f) {
+        for (int i = 0; i < 2; i++) {
+            float tc = ((i == 0 ? 0.5f : -0.5f) - r.orig[1]) / r.dir[1];
+            gm::Vector3 p = r.orig + r.dir * tc;
+            if (InRange(r, tc) && p[0] * p[0] + p[2] * p[2] <= 1.0f) {
+                r.t_max = tc;
+                part = 1 + i;
+                flag = true;
+            }
+        }
+    }
+    return flag;
+}
+
+void Cylinder::GetSurfaceFrame(const gm::Vector3 &p, int part, gm::Vector3 &norm,
+        gm::Vector3 &tan) const {
+    if (part == 0) {
+        norm = gm::Normalize(gm::Vector3(p[0], 0.0f, p[2]));
+    } else {
+        norm = gm::Vector3(0.0f, part == 1 ? 1.0f : -1.0f, 0.0f);
+    }
+    tan = TangentAroundY(p);
+}
+
 Capsule::Capsule(float radius, float height) : radius(radius), height(height) {
     id = gid::NewGID();
     float hh = height / 2.0f, r = radius;
@@ -444,4 +507,50 @@ Capsule::Capsule(float radius, float height) : radius(radius), height(height) {
     }
 }
 
+bool Capsule::IsAnalytic() const {
+    return true;
+}
+
+bool Capsule::IntersectSurface(const gm::Ray &r, int &part) const {
+    float hh = height / 2.0f;
+    bool flag = false;
+    float t[2];
+    int n = CylinderRoots(r, radius, t);
+    for (int i = 0; i < n; i++) {
+        float y = r.orig[1] + r.dir[1] * t[i];
+        if (InRange(r, t[i]) && std::abs(y) <= hh) {
+            r.t_max = t[i];
+            part = 0;
+            flag = true;
+            break;
+        }
+    }
+    // half spheres, part 1 at the top and 2 at the bottom
+    for (int j = 0; j < 2; j++) {
+        float cy = j == 0 ? hh : -hh;
+        n = SphereRoots(r, gm::Vector3(0.0f, cy, 0.0f), radius, t);
+        for (int i = 0; i < n; i++) {
+            float y = r.orig[1] + r.dir[1] * t[i];
+            if (InRange(r, t[i]) && (j == 0 ? y >= hh : y <= -hh)) {
+                r.t_max = t[i];
+                part = 1 + j;
+                flag = true;
+                break;
+            }
+        }
+    }
+    return flag;
+}
+
+void Capsule::GetSurfaceFrame(const gm::Vector3 &p, int part, gm::Vector3 &norm,
+        gm::Vector3 &tan) const {
+    float hh = height / 2.0f;
+    if (part == 0) {
+        norm = gm::Normalize(gm::Vector3(p[0], 0.0f, p[2]));
+    } else {
+        norm = gm::Normalize(p - gm::Vector3(0.0f, part == 1 ? hh : -hh, 0.0f));
+    }
+    tan = TangentAroundY(p);
+}
+
 }
\ No newline at end of file
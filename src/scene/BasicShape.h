@@ -12,12 +12,15 @@ class Cube : public Shape {
     inline static gid::GID g_gid;
 };
 
+// unit sphere
 class Sphere : public Shape {
   public:
     Sphere();
 
-    // bool Intersect(const gm::Ray &r) const override;
-    // bool Intersect(const gm::Ray &r, Intersection &inter) const override;
+    bool IsAnalytic() const override;
+    bool IntersectSurface(const gm::Ray &r, int &part) const override;
+    void GetSurfaceFrame(const gm::Vector3 &p, int part, gm::Vector3 &norm,
+        gm::Vector3 &tan) const override;
 
   private:
     inline static gid::GID g_gid;
@@ -39,10 +42,16 @@ class ScreenQuad : public Shape {
     inline static gid::GID g_gid;
 };
 
+// unit radius and height along y, with caps
 class Cylinder : public Shape {
   public:
     Cylinder();
 
+    bool IsAnalytic() const override;
+    bool IntersectSurface(const gm::Ray &r, int &part) const override;
+    void GetSurfaceFrame(const gm::Vector3 &p, int part, gm::Vector3 &norm,
+        gm::Vector3 &tan) const override;
+
   private:
     inline static gid::GID g_gid;
 };
@@ -51,6 +60,11 @@ class Capsule : public Shape {
   public:
     Capsule(float radius = 1.0f, float height = 1.0f);
 
+    bool IsAnalytic() const override;
+    bool IntersectSurface(const gm::Ray &r, int &part) const override;
+    void GetSurfaceFrame(const gm::Vector3 &p, int part, gm::Vector3 &norm,
+        gm::Vector3 &tan) const override;
+
   private:
     float radius, height;
 };
@@ -73,6 +73,10 @@ int Shape::GetIndexCount() const {
 }
 
 gm::BBox Shape::GetBBox() const {
+    return model.TransformBBox(GetLocalBBox());
+}
+
+gm::BBox Shape::GetLocalBBox() const {
     if (!bbox_valid) {
         int N = positions.size();
         gm::Vector3 p_min = positions[0], p_max = positions[0];
@@ -83,7 +87,7 @@ gm::BBox Shape::GetBBox() const {
         bbox = gm::BBox(p_min, p_max);
         bbox_valid = true;
     }
-    return model.TransformBBox(bbox);
+    return bbox;
 }
 
 gm::Transform Shape::GetModel() const {
@@ -120,6 +124,10 @@ void Shape::SetMaterial(const Material &mat) {
 }
 
 bool Shape::Intersect(const gm::Ray &r) const {
+    if (IsAnalytic()) {
+        int part;
+        return IntersectSurface(model.InvTransformRay(r), part);
+    }
     int M = indices.size();
     for (int i = 0; i < M; i += 3) {
         if (Triangle(this, indices[i], indices[i + 1], indices[i + 2]).Intersect(r)) {
@@ -128,7 +136,25 @@ bool Shape::Intersect(const gm::Ray &r) const {
     }
     return false;
 }
-bool Shape::Intersect(const gm::Ray &r, Intersection &inter) const {
+bool Shape::Intersect(const gm::Ray &r_, Intersection &inter) const {
+    if (IsAnalytic()) {
+        gm::Ray r = model.InvTransformRay(r_);
+        int part;
+        if (!IntersectSurface(r, part)) {
+            return false;
+        }
+        GetSurfaceFrame(r.orig + r.dir * r.t_max, part, inter.norm, inter.tan);
+        if (gm::Dot(inter.norm, r.dir) > 0) {
+            inter.norm = -inter.norm;
+            inter.tan = -inter.tan;
+        }
+        inter.prim = this;
+        r = model.TransformRay(r);
+        inter.TransformedBy(model);
+        inter.t = r_.t_max = r.t_max;
+        return true;
+    }
+    const gm::Ray &r = r_;
     int M = indices.size();
     for (int i = 0; i < M; i += 3) {
         if (Triangle(this, indices[i], indices[i + 1], indices[i + 2])
@@ -139,4 +165,18 @@ bool Shape::Intersect(const gm::Ray &r, Intersection &inter) const {
     return false;
 }
 
+bool Shape::IsAnalytic() const {
+    return false;
+}
+
+bool Shape::IntersectSurface(const gm::Ray &r, int &part) const {
+    return false;
+}
+
+void Shape::GetSurfaceFrame(const gm::Vector3 &p, int part, gm::Vector3 &norm,
+        gm::Vector3 &tan) const {
+    norm = gm::Vector3(0.0f, 1.0f, 0.0f);
+    tan = gm::Vector3(1.0f, 0.0f, 0.0f);
+}
+
 }
\ No newline at end of file
@@ -34,6 +34,8 @@ class Shape : public Primitive {
     gm::Transform GetModel() const;
     void SetModel(const gm::Transform &trans);
     gm::BBox GetBBox() const override;
+    // bounds in object space, without the model transform
+    gm::BBox GetLocalBBox() const;
     gid::GID GetID() const;
     gm::Vector3 GetCentroid() const;
 
@@ -44,6 +46,16 @@ class Shape : public Primitive {
     bool Intersect(const gm::Ray &r) const override;
     bool Intersect(const gm::Ray &r, Intersection &inter) const override;
 
+    // shapes with an exact surface, which is intersected instead of the
+    // triangles, those are then only used for rasterization
+    virtual bool IsAnalytic() const;
+    // closest hit of the surface in object space, shrinks r.t_max and returns
+    // which part of the surface is hit
+    virtual bool IntersectSurface(const gm::Ray &r, int &part) const;
+    // normal and tangent at p on a part of the surface, in object space
+    virtual void GetSurfaceFrame(const gm::Vector3 &p, int part, gm::Vector3 &norm,
+        gm::Vector3 &tan) const;
+
   protected:
     gm::Transform model;
     mutable gm::BBox bbox;
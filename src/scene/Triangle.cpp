@@ -1,160 +1,116 @@
 #include "Triangle.h"
 
+#include <cmath>
+#include <utility>
+
 namespace pepcy::renderer {
 
 Triangle::Triangle(const Shape *sh, int v0, int v1, int v2) :
         sh(sh), v0(v0), v1(v1), v2(v2) {}
 
-static bool DoesRayIntersectSegment(const gm::Ray &r, const gm::Vector3 &v0,
-        const gm::Vector3 &v1, float &t) {
-    gm::Vector3 u = v1 - v0;
-    gm::Vector3 v = gm::Cross(u, r.dir);
-    if (v.Norm2() == 0) {
+// watertight test of woop et al. the ray is sheared onto its longest axis and
+// the edges are tested in 2d, so rays never slip through shared edges and
+// edge-on triangles are missed, u and v weight p1 and p2
+static bool IntersectWatertight(const gm::Ray &r, const gm::Vector3 &p0,
+        const gm::Vector3 &p1, const gm::Vector3 &p2, float &t, float &u, float &v) {
+    gm::Vector3 a(std::abs(r.dir[0]), std::abs(r.dir[1]), std::abs(r.dir[2]));
+    int kz = a[0] > a[1] ? (a[0] > a[2] ? 0 : 2) : (a[1] > a[2] ? 1 : 2);
+    int kx = (kz + 1) % 3;
+    int ky = (kx + 1) % 3;
+    if (r.dir[kz] < 0.0f) {
+        std::swap(kx, ky);
+    }
+    float sx = r.dir[kx] / r.dir[kz];
+    float sy = r.dir[ky] / r.dir[kz];
+    float sz = 1.0f / r.dir[kz];
+
+    const gm::Vector3 *p[3] = { &p0, &p1, &p2 };
+    float ax[3], ay[3], az[3];
+    for (int k = 0; k < 3; k++) {
+        gm::Vector3 q = *p[k] - r.orig;
+        ax[k] = q[kx] - sx * q[kz];
+        ay[k] = q[ky] - sy * q[kz];
+        az[k] = sz * q[kz];
+    }
+    float e0 = ax[2] * ay[1] - ay[2] * ax[1];
+    float e1 = ax[0] * ay[2] - ay[0] * ax[2];
+    float e2 = ax[1] * ay[0] - ay[1] * ax[0];
+    if (e0 == 0.0f || e1 == 0.0f || e2 == 0.0f) {
+        e0 = float(double(ax[2]) * ay[1] - double(ay[2]) * ax[1]);
+        e1 = float(double(ax[0]) * ay[2] - double(ay[0]) * ax[2]);
+        e2 = float(double(ax[1]) * ay[0] - double(ay[1]) * ax[0]);
+    }
+    if ((e0 < 0.0f || e1 < 0.0f || e2 < 0.0f) && (e0 > 0.0f || e1 > 0.0f || e2 > 0.0f)) {
         return false;
     }
-    gm::Vector3 w = gm::Cross(u, v);
-    float c = gm::Dot(w, v0);
-    float temp = gm::Dot(w, r.dir);
-    if (temp == 0) {
+    float det = e0 + e1 + e2;
+    if (det == 0.0f) {
         return false;
     }
-    t = (c - gm::Dot(w, r.orig)) / temp;
-    gm::Vector3 p = r.orig + r.dir * t;
-    float ut = gm::Dot(p - v0, u) / u.Norm();
-    return ut >= 0.0f && ut <= 1.0f;
+    float inv_det = 1.0f / det;
+    t = (e0 * az[0] + e1 * az[1] + e2 * az[2]) * inv_det;
+    u = e1 * inv_det;
+    v = e2 * inv_det;
+    return !(t < r.t_min || t > r.t_max);
 }
 
 bool Triangle::Intersect(const gm::Ray &r_) const {
+    gm::Ray r = sh->GetModel().InvTransformRay(r_);
+    return IntersectLocal(r);
+}
+
+bool Triangle::Intersect(const gm::Ray &r_, Intersection &inter) const {
     auto trans = sh->GetModel();
     gm::Ray r = trans.InvTransformRay(r_);
+    if (!IntersectLocal(r, inter)) {
+        return false;
+    }
+    r = trans.TransformRay(r);
+    inter.TransformedBy(trans);
+    inter.t = r_.t_max = r.t_max;
+    return true;
+}
 
-    gm::Vector3 p0 = sh->GetPosition(v0);
-    gm::Vector3 p1 = sh->GetPosition(v1);
-    gm::Vector3 p2 = sh->GetPosition(v2);
-    gm::Vector3 e1 = p1 - p0;
-    gm::Vector3 e2 = p2 - p0;
-    gm::Vector3 s = r.orig - p0;
+bool Triangle::IntersectLocal(const gm::Ray &r) const {
+    float t, u, v;
+    return IntersectWatertight(r, sh->GetPosition(v0), sh->GetPosition(v1),
+        sh->GetPosition(v2), t, u, v);
+}
 
-    float det = gm::Dot(gm::Cross(e1, r.dir), e2);
-    // float det = gm::Mix(e2, e1, r.dir);
-    if (det != 0) {
-        float du = -gm::Dot(gm::Cross(s, e2), r.dir);
-        float dv = gm::Dot(gm::Cross(e1, r.dir), s);
-        float dt = -gm::Dot(gm::Cross(s, e2), e1);
-        float u = du / det;
-        float v = dv / det;
-        float t = dt / det;
-        if (u < 0 || v < 0 || 1 - u - v < 0) {
-            return false;
-        } else {
-            return !(t < r.t_min || t > r.t_max);
-        }
-    } else {
-        float t;
-        if (DoesRayIntersectSegment(r, p0, p1, t)) {
-            return !(t < r.t_min || t > r.t_max);
-        } else if (DoesRayIntersectSegment(r, p0, p2, t)) {
-            return !(t < r.t_min || t > r.t_max);
-        } else if (DoesRayIntersectSegment(r, p1, p2, t)) {
-            return !(t < r.t_min || t > r.t_max);
-        }
+bool Triangle::IntersectLocal(const gm::Ray &r, Intersection &inter) const {
+    float t, u, v;
+    if (!IntersectWatertight(r, sh->GetPosition(v0), sh->GetPosition(v1),
+            sh->GetPosition(v2), t, u, v)) {
+        return false;
     }
-
-    return false;
+    Interpolate(r, t, u, v, inter);
+    r.t_max = t;
+    return true;
 }
 
-bool Triangle::Intersect(const gm::Ray &r_, Intersection &inter) const {
-    auto trans = sh->GetModel();
-    gm::Ray r = trans.InvTransformRay(r_);
-    
-    gm::Vector3 p0 = sh->GetPosition(v0);
-    gm::Vector3 p1 = sh->GetPosition(v1);
-    gm::Vector3 p2 = sh->GetPosition(v2);
+void Triangle::Interpolate(const gm::Ray &r, float t, float u, float v,
+        Intersection &inter) const {
     gm::Vector3 n0 = sh->GetNormal(v0);
     gm::Vector3 n1 = sh->GetNormal(v1);
     gm::Vector3 n2 = sh->GetNormal(v2);
     gm::Vector3 tan0 = sh->GetTangent(v0);
     gm::Vector3 tan1 = sh->GetTangent(v1);
     gm::Vector3 tan2 = sh->GetTangent(v2);
-    gm::Vector3 e1 = p1 - p0;
-    gm::Vector3 e2 = p2 - p0;
-    gm::Vector3 s = r.orig - p0;
-
-    float det = gm::Dot(gm::Cross(e1, r.dir), e2);
-    if (det != 0) {
-        float du = -gm::Dot(gm::Cross(s, e2), r.dir);
-        float dv = gm::Dot(gm::Cross(e1, r.dir), s);
-        float dt = -gm::Dot(gm::Cross(s, e2), e1);
-        float u = du / det;
-        float v = dv / det;
-        float t = dt / det;
-        if (u < 0 || v < 0 || 1 - u - v < 0) {
-            return false;
-        } else if (t < r.t_min || t > r.t_max) {
-            return false;
-        }
-        inter.norm = n0 * u + n1 * v + n2 * (1 - u - v);
-        inter.tan = tan0 * u + tan1 * v + tan2 * (1 - u - v);
-        if (gm::Dot(inter.norm, r.dir) > 0) {
-            inter.norm = -inter.norm;
-            inter.tan = -inter.tan;
-        }
-        r.t_max = t;
-        inter.prim = this;
-        r = trans.TransformRay(r);
-        inter.TransformedBy(trans);
-        inter.t = r_.t_max = r.t_max;
-        return true;
-    } else {
-        gm::Matrix3 inv(p0, p1, p2);
-        inv = gm::Inverse(inv);
-        bool flag = false;
-        float t, u, v;
-        if (DoesRayIntersectSegment(r, p0, p1, t)) {
-            if (t < r.t_min || t > r.t_max) {
-                return false;
-            }
-            gm::Vector3 ret = inv * (r.orig + r.dir * t);
-            u = ret[0];
-            v = ret[1];
-            flag = true;
-        } else if (DoesRayIntersectSegment(r, p0, p2, t)) {
-            if (t < r.t_min || t > r.t_max) {
-                return false;
-            }
-            gm::Vector3 ret = inv * (r.orig + r.dir * t);
-            u = ret[0];
-            v = ret[1];
-            flag = true;
-        } else if (DoesRayIntersectSegment(r, p1, p2, t)) {
-            if (t < r.t_min || t > r.t_max) {
-                return false;
-            }
-            gm::Vector3 ret = inv * (r.orig + r.dir * t);
-            u = ret[0];
-            v = ret[1];
-            flag = true;
-        }
-        if (!flag) {
-            return false;
-        }
-        inter.norm = n0 * u + n1 * v + n2 * (1 - u - v);
-        inter.tan = tan0 * u + tan1 * v + tan2 * (1 - u - v);
-        if (gm::Dot(inter.norm, r.dir) > 0) {
-            inter.norm = -inter.norm;
-            inter.tan = -inter.tan;
-        }
-        r.t_max = t;
-        inter.prim = this;
-        inter.TransformedBy(trans);
-        r = trans.TransformRay(r);
-        inter.t = r_.t_max = r.t_max;
-        return true;
+    inter.norm = n0 * (1 - u - v) + n1 * u + n2 * v;
+    inter.tan = tan0 * (1 - u - v) + tan1 * u + tan2 * v;
+    if (gm::Dot(inter.norm, r.dir) > 0) {
+        inter.norm = -inter.norm;
+        inter.tan = -inter.tan;
     }
-    return false;
+    inter.t = t;
+    inter.prim = this;
 }
 
 gm::BBox Triangle::GetBBox() const {
+    return sh->GetModel().TransformBBox(GetLocalBBox());
+}
+
+gm::BBox Triangle::GetLocalBBox() const {
     gm::Vector3 p0 = sh->GetPosition(v0);
     gm::Vector3 p1 = sh->GetPosition(v1);
     gm::Vector3 p2 = sh->GetPosition(v2);
@@ -162,7 +118,7 @@ gm::BBox Triangle::GetBBox() const {
     gm::Vector3 pmax = gm::Max(p0, gm::Max(p1, p2));
     pmin -= gm::Vector3(0.001f, 0.001f, 0.001f);
     pmax += gm::Vector3(0.001f, 0.001f, 0.001f);
-    return sh->GetModel().TransformBBox(gm::BBox(pmin, pmax));
+    return gm::BBox(pmin, pmax);
 }
 
 const Material &Triangle::GetMaterial() const {
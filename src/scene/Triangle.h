@@ -12,6 +12,15 @@ class Triangle : public Primitive {
     bool Intersect(const gm::Ray &r, Intersection &inter) const override;
     gm::BBox GetBBox() const override;
 
+    // same tests in the object space of the shape, without its model transform
+    bool IntersectLocal(const gm::Ray &r) const;
+    bool IntersectLocal(const gm::Ray &r, Intersection &inter) const;
+    gm::BBox GetLocalBBox() const;
+    // fills inter for a hit of r at t, u and v weight the second and the
+    // third vertex
+    void Interpolate(const gm::Ray &r, float t, float u, float v,
+        Intersection &inter) const;
+
     const Material &GetMaterial() const;
 
   private: